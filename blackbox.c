@@ -0,0 +1,358 @@
+#define _GNU_SOURCE
+#include "blackbox.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+// Space is reserved on the card a chunk at a time so appending blocks never
+// has to allocate clusters on the way.
+#define BLACKBOX_CHUNK_SIZE (1024 * 1024)
+
+// A partially filled block is rewritten at most this often (microseconds),
+// which bounds both the data lost on power failure and the extra writes.
+#define BLACKBOX_FLUSH_INTERVAL 1000000
+
+// Largest encoded record: type, delta, and the biggest payload
+#define BLACKBOX_RECORD_MAX 32
+
+// Blocks waiting for the writer thread; a power of two
+#define BLACKBOX_QUEUE 64
+
+// The writer thread only makes system calls
+#define BLACKBOX_STACK (64 * 1024)
+
+// The main loop builds blocks and copies each finished or flushed one into a
+// queue; a thread of its own preallocates and writes them, so a slow card
+// never holds up the loop. A rewrite of the partial block is queued like any
+// other and lands after the earlier copy. The loop owns head and dropped,
+// the thread owns tail and allocated.
+struct blackbox
+{
+	int fd;
+	atomic_int failed;
+
+	uint8_t *block;
+	size_t length;
+	uint32_t sequence;
+
+	uint64_t offset;
+
+	uint64_t flush_time;
+	uint64_t last_time;
+
+	uint8_t *queue;
+	uint64_t offsets[BLACKBOX_QUEUE];
+	atomic_uint head;
+	atomic_uint tail;
+	uint32_t dropped;
+
+	uint64_t allocated;
+	int event_fd;
+	atomic_int stopping;
+	int running;
+	pthread_t thread;
+};
+
+static const char *_error;
+
+uint64_t blackbox_now(void)
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000 + ((uint64_t)time.tv_nsec + 500) / 1000;
+}
+
+static size_t blackbox_put_varint(uint8_t *data, uint64_t value)
+{
+	size_t length = 0;
+
+	while(value >= 0x80)
+	{
+		data[length++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+
+	data[length++] = value;
+	return length;
+}
+
+static uint64_t blackbox_zigzag(int64_t value)
+{
+	return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static void *blackbox_thread(void *data)
+{
+	blackbox_t blackbox = (blackbox_t)data;
+	unsigned int tail = atomic_load_explicit(&blackbox->tail, memory_order_relaxed);
+
+	while(1)
+	{
+		unsigned int head = atomic_load_explicit(&blackbox->head, memory_order_acquire);
+		unsigned int slot = tail % BLACKBOX_QUEUE;
+		uint64_t offset;
+
+		if(head == tail)
+		{
+			eventfd_t events;
+
+			// Blocks queued before the flag was set are visible once it is,
+			// so look again before leaving
+			if(atomic_load_explicit(&blackbox->stopping, memory_order_acquire))
+			{
+				if(atomic_load_explicit(&blackbox->head, memory_order_acquire) == tail) break;
+				continue;
+			}
+
+			eventfd_read(blackbox->event_fd, &events);
+			continue;
+		}
+
+		offset = blackbox->offsets[slot];
+		if(offset + BLACKBOX_BLOCK_SIZE > blackbox->allocated)
+		{
+			// Not every filesystem can preallocate; the writes work regardless
+			fallocate(blackbox->fd, FALLOC_FL_KEEP_SIZE, blackbox->allocated, BLACKBOX_CHUNK_SIZE);
+			blackbox->allocated += BLACKBOX_CHUNK_SIZE;
+		}
+
+		if(pwrite(blackbox->fd, blackbox->queue + slot * BLACKBOX_BLOCK_SIZE, BLACKBOX_BLOCK_SIZE, offset) != BLACKBOX_BLOCK_SIZE)
+			atomic_store_explicit(&blackbox->failed, 1, memory_order_relaxed);
+
+		atomic_store_explicit(&blackbox->tail, ++tail, memory_order_release);
+	}
+
+	return 0;
+}
+
+// Copies the block being built into the queue for the writer thread. A full
+// queue drops the copy rather than wait; a dropped flush of a partial block
+// is made good by the next one.
+static void blackbox_queue(blackbox_t blackbox, uint64_t offset)
+{
+	unsigned int head = atomic_load_explicit(&blackbox->head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&blackbox->tail, memory_order_acquire);
+	unsigned int slot = head % BLACKBOX_QUEUE;
+
+	if(atomic_load_explicit(&blackbox->failed, memory_order_relaxed)) return;
+
+	if(head - tail >= BLACKBOX_QUEUE)
+	{
+		blackbox->dropped++;
+		return;
+	}
+
+	memcpy(blackbox->queue + slot * BLACKBOX_BLOCK_SIZE, blackbox->block, BLACKBOX_BLOCK_SIZE);
+	blackbox->offsets[slot] = offset;
+	atomic_store_explicit(&blackbox->head, head + 1, memory_order_release);
+	eventfd_write(blackbox->event_fd, 1);
+}
+
+static void blackbox_write_block(blackbox_t blackbox)
+{
+	blackbox_block_t *header = (blackbox_block_t *)blackbox->block;
+
+	header->length = blackbox->length;
+	blackbox_queue(blackbox, blackbox->offset);
+}
+
+static void blackbox_start_block(blackbox_t blackbox, uint64_t time)
+{
+	blackbox_block_t *header = (blackbox_block_t *)blackbox->block;
+
+	memset(blackbox->block, 0, BLACKBOX_BLOCK_SIZE);
+	header->time = time;
+	header->sequence = blackbox->sequence++;
+
+	blackbox->length = sizeof(blackbox_block_t);
+	blackbox->last_time = time;
+}
+
+static void blackbox_append(blackbox_t blackbox, uint8_t type, uint64_t time, const uint8_t *payload, size_t length)
+{
+	uint8_t record[BLACKBOX_RECORD_MAX];
+	size_t size = 0;
+
+	// Records never span blocks; a full block goes to the card as it is
+	if(blackbox->length + BLACKBOX_RECORD_MAX > BLACKBOX_BLOCK_SIZE)
+	{
+		blackbox_write_block(blackbox);
+		blackbox->offset += BLACKBOX_BLOCK_SIZE;
+		blackbox->flush_time = time;
+		blackbox_start_block(blackbox, time);
+	}
+
+	record[size++] = type;
+	size += blackbox_put_varint(record + size, blackbox_zigzag((int64_t)(time - blackbox->last_time)));
+	memcpy(record + size, payload, length);
+	size += length;
+
+	memcpy(blackbox->block + blackbox->length, record, size);
+	blackbox->length += size;
+	blackbox->last_time = time;
+
+	// Records queued by other threads can be slightly older than the last
+	if((int64_t)(time - blackbox->flush_time) >= BLACKBOX_FLUSH_INTERVAL)
+	{
+		blackbox_write_block(blackbox);
+		blackbox->flush_time = time;
+	}
+}
+
+// Waits for the queued blocks, at most BLACKBOX_QUEUE of them, to be written
+void blackbox_close(blackbox_t blackbox)
+{
+	if(blackbox)
+	{
+		if(blackbox->running)
+		{
+			if(blackbox->length > sizeof(blackbox_block_t))
+				blackbox_write_block(blackbox);
+
+			atomic_store_explicit(&blackbox->stopping, 1, memory_order_release);
+			eventfd_write(blackbox->event_fd, 1);
+			pthread_join(blackbox->thread, 0);
+		}
+
+		if(blackbox->fd >= 0) close(blackbox->fd);
+		if(blackbox->event_fd >= 0) close(blackbox->event_fd);
+		free(blackbox->queue);
+		free(blackbox->block);
+		free(blackbox);
+	}
+}
+
+uint32_t blackbox_dropped(blackbox_t blackbox)
+{
+	return blackbox->dropped;
+}
+
+const char *blackbox_error(void)
+{
+	return _error;
+}
+
+void blackbox_frame(blackbox_t blackbox, uint64_t time, int64_t pts, uint32_t flags)
+{
+	uint8_t payload[BLACKBOX_RECORD_MAX - 1 - 10];
+	size_t length;
+
+	length = blackbox_put_varint(payload, blackbox_zigzag(pts));
+	length += blackbox_put_varint(payload + length, flags);
+
+	blackbox_append(blackbox, BLACKBOX_FRAME, time, payload, length);
+}
+
+void blackbox_input(blackbox_t blackbox, uint64_t time, uint16_t width)
+{
+	uint8_t payload[3];
+	size_t length = blackbox_put_varint(payload, width);
+
+	blackbox_append(blackbox, BLACKBOX_INPUT, time, payload, length);
+}
+
+blackbox_t blackbox_open(const char *path)
+{
+	blackbox_t blackbox = 0;
+	blackbox_header_t *header;
+	pthread_attr_t attr;
+	struct timespec wall;
+	int status;
+
+	blackbox = malloc(sizeof(struct blackbox));
+	if(!blackbox)
+	{
+		_error = "Failed to allocate blackbox object.";
+		goto fail;
+	}
+	memset(blackbox, 0, sizeof(struct blackbox));
+	blackbox->fd = -1;
+	blackbox->event_fd = -1;
+
+	if(posix_memalign((void **)&blackbox->block, BLACKBOX_BLOCK_SIZE, BLACKBOX_BLOCK_SIZE))
+	{
+		blackbox->block = 0;
+		_error = "Failed to allocate blackbox block.";
+		goto fail;
+	}
+
+	if(posix_memalign((void **)&blackbox->queue, BLACKBOX_BLOCK_SIZE, BLACKBOX_QUEUE * BLACKBOX_BLOCK_SIZE))
+	{
+		blackbox->queue = 0;
+		_error = "Failed to allocate blackbox queue.";
+		goto fail;
+	}
+
+	blackbox->event_fd = eventfd(0, EFD_CLOEXEC);
+	if(blackbox->event_fd < 0)
+	{
+		_error = "Failed to create blackbox event.";
+		goto fail;
+	}
+
+	blackbox->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(blackbox->fd < 0)
+	{
+		_error = strerror(errno);
+		goto fail;
+	}
+
+	// The header takes the first block so data blocks stay aligned
+	memset(blackbox->block, 0, BLACKBOX_BLOCK_SIZE);
+	header = (blackbox_header_t *)blackbox->block;
+	header->magic = BLACKBOX_MAGIC;
+	header->version = BLACKBOX_VERSION;
+	header->block_size = BLACKBOX_BLOCK_SIZE;
+	header->start_time = blackbox_now();
+
+	clock_gettime(CLOCK_REALTIME, &wall);
+	header->wall_time = (uint64_t)wall.tv_sec * 1000000 + wall.tv_nsec / 1000;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, BLACKBOX_STACK);
+	status = pthread_create(&blackbox->thread, &attr, blackbox_thread, blackbox);
+	pthread_attr_destroy(&attr);
+
+	if(status)
+	{
+		_error = "Failed to start blackbox thread.";
+		goto fail;
+	}
+	blackbox->running = 1;
+
+	// The header takes the first slot in the queue like any block
+	blackbox_queue(blackbox, 0);
+
+	blackbox->offset = BLACKBOX_BLOCK_SIZE;
+	blackbox->flush_time = header->start_time;
+	blackbox_start_block(blackbox, header->start_time);
+
+	return blackbox;
+
+fail:
+	blackbox_close(blackbox);
+	return 0;
+}
+
+void blackbox_record(blackbox_t blackbox, uint8_t recording)
+{
+	blackbox_append(blackbox, BLACKBOX_RECORD, blackbox_now(), &recording, 1);
+}
+
+void blackbox_telem(blackbox_t blackbox, uint64_t time, uint8_t id, uint16_t value)
+{
+	uint8_t payload[4];
+	size_t length;
+
+	payload[0] = id;
+	length = 1 + blackbox_put_varint(payload + 1, value);
+
+	blackbox_append(blackbox, BLACKBOX_TELEM, time, payload, length);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdint.h>
+
+#define BLACKBOX_MAGIC 0x42565046
+#define BLACKBOX_VERSION 1
+
+#define BLACKBOX_BLOCK_SIZE 4096
+
+// Record types. Each record is the type, the microseconds since the previous
+// record in the block as a zigzag varint, then the payload.
+#define BLACKBOX_PADDING 0
+#define BLACKBOX_TELEM 1 // ID byte, value varint
+#define BLACKBOX_INPUT 2 // pulse width varint, in microseconds
+#define BLACKBOX_RECORD 3 // byte, 1 when recording starts and 0 when it stops
+#define BLACKBOX_FRAME 4 // zigzag varint PTS, then the MMAL buffer flags varint
+
+// The file starts with a header block, then data blocks that each begin with
+// this header; a block can be decoded without reading any before it.
+typedef struct
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t block_size;
+	uint64_t start_time;
+	uint64_t wall_time;
+} blackbox_header_t;
+
+typedef struct
+{
+	uint64_t time;
+	uint32_t sequence;
+	uint16_t length;
+	uint16_t reserved;
+} blackbox_block_t;
+
+typedef struct blackbox *blackbox_t;
+
+blackbox_t blackbox_open(const char *path);
+void blackbox_close(blackbox_t blackbox);
+const char *blackbox_error(void);
+
+uint32_t blackbox_dropped(blackbox_t blackbox);
+uint64_t blackbox_now(void);
+
+void blackbox_frame(blackbox_t blackbox, uint64_t time, int64_t pts, uint32_t flags);
+void blackbox_input(blackbox_t blackbox, uint64_t time, uint16_t width);
+void blackbox_record(blackbox_t blackbox, uint8_t recording);
+void blackbox_telem(blackbox_t blackbox, uint64_t time, uint8_t id, uint16_t value);
@@ -0,0 +1,936 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blackbox.h"
+#include "telem.h"
+
+#define FIELDS_MAX 64
+
+// Subtitles change at most this often unless -t says otherwise
+#define SRT_INTERVAL 500000
+
+// PTS reported by MMAL when the encoder has none
+#define PTS_UNKNOWN INT64_MIN
+
+enum
+{
+	FORMAT_CSV,
+	FORMAT_JSON,
+	FORMAT_SRT,
+};
+
+enum
+{
+	FIELD_RAW,
+	FIELD_SNAPSHOT,
+	FIELD_INPUT,
+	FIELD_RECORDING,
+};
+
+typedef struct
+{
+	const char *name;
+	uint8_t kind;
+	uint8_t id, id2;
+	uint8_t is_signed;
+	uint16_t divisor;
+	const char *unit;
+	int32_t (*get)(const telem_snapshot_t *);
+} field_t;
+
+typedef struct
+{
+	uint8_t type;
+	uint64_t time;
+	uint64_t a, b;
+} record_t;
+
+typedef struct
+{
+	telem_snapshot_t snapshot;
+	uint16_t input;
+	uint8_t recording;
+
+	// Video time is the PTS of the last frame plus the time since it
+	int frames;
+	uint64_t first_time, frame_time;
+	int64_t first_pts, frame_pts;
+} state_t;
+
+typedef struct
+{
+	int format;
+	uint64_t interval;
+
+	const field_t *fields[FIELDS_MAX];
+	int field_count;
+
+	uint64_t start_time;
+	unsigned int rows;
+
+	// Rows are held back by one so SRT entries know when they end
+	int pending;
+	uint64_t pending_time;
+	int64_t pending_video;
+	int32_t pending_values[FIELDS_MAX];
+} export_t;
+
+static int32_t field_altitude(const telem_snapshot_t *snapshot)
+{
+	return telem_snapshot_get_altitude(snapshot);
+}
+
+static int32_t field_cell(const telem_snapshot_t *snapshot)
+{
+	return telem_snapshot_get_cell_voltage(snapshot);
+}
+
+static int32_t field_heading(const telem_snapshot_t *snapshot)
+{
+	return telem_snapshot_get_heading(snapshot);
+}
+
+static int32_t field_vfas(const telem_snapshot_t *snapshot)
+{
+	return telem_snapshot_get_vfas_voltage(snapshot);
+}
+
+static int32_t field_vspeed(const telem_snapshot_t *snapshot)
+{
+	return telem_snapshot_get_vspeed(snapshot);
+}
+
+static const field_t _fields[] = {
+	{"altitude", FIELD_SNAPSHOT, TELEM_ID_ALT, TELEM_ID_ALT_FRAC, 1, 100, "m", field_altitude},
+	{"cell", FIELD_SNAPSHOT, TELEM_ID_CELL, 0, 0, 1000, "V", field_cell},
+	{"heading", FIELD_SNAPSHOT, TELEM_ID_HEADING, TELEM_ID_HEADING_FRAC, 0, 100, "deg", field_heading},
+	{"vfas", FIELD_SNAPSHOT, TELEM_ID_VFAS, 0, 0, 1000, "V", field_vfas},
+	{"vspeed", FIELD_SNAPSHOT, TELEM_ID_VSPEED, 0, 1, 100, "m/s", field_vspeed},
+	{"cell_min", FIELD_RAW, TELEM_ID_CELL_MIN, 0, 0, 1000, "V"},
+	{"consumed", FIELD_RAW, TELEM_ID_CONSUMED, 0, 0, 1, "mAh"},
+	{"home_distance", FIELD_RAW, TELEM_ID_HOME_DISTANCE, 0, 0, 1, "m"},
+	{"home_bearing", FIELD_RAW, TELEM_ID_HOME_BEARING, 0, 0, 1, "deg"},
+	{"current", FIELD_RAW, TELEM_ID_CURRENT, 0, 0, 10, "A"},
+	{"capacity", FIELD_RAW, TELEM_ID_CAPACITY, 0, 0, 1, "mAh"},
+	{"fuel", FIELD_RAW, TELEM_ID_FUEL, 0, 0, 1, "%"},
+	{"gps_alt", FIELD_RAW, TELEM_ID_GPS_ALT, 0, 1, 1, "m"},
+	{"gps_fix", FIELD_RAW, TELEM_ID_GPS_FIX, 0, 0, 1, ""},
+	{"gps_sats", FIELD_RAW, TELEM_ID_GPS_SATS, 0, 0, 1, ""},
+	{"gps_speed", FIELD_RAW, TELEM_ID_GPS_SPEED, 0, 0, 1, "kn"},
+	{"link_quality", FIELD_RAW, TELEM_ID_LINK_QUALITY, 0, 0, 1, "%"},
+	{"pitch", FIELD_RAW, TELEM_ID_PITCH, 0, 1, 10, "deg"},
+	{"roll", FIELD_RAW, TELEM_ID_ROLL, 0, 1, 10, "deg"},
+	{"rpm", FIELD_RAW, TELEM_ID_RPM, 0, 0, 1, "rpm"},
+	{"rssi", FIELD_RAW, TELEM_ID_RSSI, 0, 0, 1, ""},
+	{"snr", FIELD_RAW, TELEM_ID_SNR, 0, 1, 1, "dB"},
+	{"temp1", FIELD_RAW, TELEM_ID_TEMP1, 0, 1, 1, "C"},
+	{"temp2", FIELD_RAW, TELEM_ID_TEMP2, 0, 1, 1, "C"},
+	{"vario", FIELD_RAW, TELEM_ID_VARIO, 0, 1, 100, "m/s"},
+	{"input", FIELD_INPUT, 0, 0, 0, 1, "us"},
+	{"recording", FIELD_RECORDING, 0, 0, 0, 1, ""},
+};
+
+#define FIELDS (sizeof(_fields) / sizeof(_fields[0]))
+
+// Fields named on the command line that are not in the table
+static field_t _extra_fields[FIELDS_MAX];
+static char _extra_names[FIELDS_MAX][8];
+static int _extra_count;
+
+static const char *_default_fields = "altitude,vfas,cell,heading,input,recording";
+
+static const field_t *field_find(const char *name)
+{
+	unsigned int i, id;
+	char *end;
+	field_t *field;
+
+	for(i = 0; i < FIELDS; i++)
+		if(!strcmp(name, _fields[i].name)) return &_fields[i];
+
+	if(_extra_count == FIELDS_MAX) return 0;
+	field = &_extra_fields[_extra_count];
+
+	// chN for RC channels, or any raw ID as a number
+	if(name[0] == 'c' && name[1] == 'h')
+	{
+		id = strtoul(name + 2, &end, 10);
+		if(*end || id < 1 || id > TELEM_CHANNELS) return 0;
+		id += TELEM_ID_CHANNEL - 1;
+		field->unit = "us";
+	}
+	else
+	{
+		id = strtoul(name, &end, 0);
+		if(*end || end == name || id > 255) return 0;
+		field->unit = "";
+	}
+
+	snprintf(_extra_names[_extra_count], sizeof(_extra_names[0]), "%s", name);
+	field->name = _extra_names[_extra_count];
+	field->kind = FIELD_RAW;
+	field->id = id;
+	field->divisor = 1;
+
+	_extra_count++;
+	return field;
+}
+
+static int32_t field_value(const field_t *field, const state_t *state)
+{
+	switch(field->kind)
+	{
+		case FIELD_SNAPSHOT:
+			return field->get(&state->snapshot);
+
+		case FIELD_INPUT:
+			return state->input;
+
+		case FIELD_RECORDING:
+			return state->recording;
+
+		default:
+			if(field->is_signed) return (int16_t)state->snapshot.values[field->id];
+			return state->snapshot.values[field->id];
+	}
+}
+
+static void print_value(int32_t value, uint16_t divisor)
+{
+	int decimals = 0;
+	uint16_t scale;
+
+	if(divisor == 1)
+	{
+		printf("%d", value);
+		return;
+	}
+
+	for(scale = divisor; scale > 1; scale /= 10)
+		decimals++;
+
+	printf("%s%d.%0*d", value < 0 ? "-" : "", abs(value) / divisor, decimals, abs(value) % divisor);
+}
+
+static void print_seconds(uint64_t microseconds)
+{
+	printf("%llu.%03llu", (unsigned long long)(microseconds / 1000000), (unsigned long long)(microseconds / 1000 % 1000));
+}
+
+static void print_srt_time(uint64_t microseconds)
+{
+	uint64_t ms = microseconds / 1000;
+
+	printf("%02llu:%02llu:%02llu,%03llu",
+		(unsigned long long)(ms / 3600000),
+		(unsigned long long)(ms / 60000 % 60),
+		(unsigned long long)(ms / 1000 % 60),
+		(unsigned long long)(ms % 1000));
+}
+
+static size_t get_varint(const uint8_t *data, size_t length, uint64_t *value)
+{
+	size_t offset = 0;
+	int shift = 0;
+
+	*value = 0;
+	while(offset < length && shift < 64)
+	{
+		uint8_t byte = data[offset++];
+		*value |= (uint64_t)(byte & 0x7f) << shift;
+		if(!(byte & 0x80)) return offset;
+		shift += 7;
+	}
+
+	return 0;
+}
+
+static int64_t unzigzag(uint64_t value)
+{
+	return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+// Returns the data block at the index, or null if it is torn or unwritten
+static const blackbox_block_t *block_get(const uint8_t *data, size_t block_size, size_t index)
+{
+	const blackbox_block_t *block = (const blackbox_block_t *)(data + (index + 1) * block_size);
+
+	if(block->sequence != index) return 0;
+	if(block->length < sizeof(blackbox_block_t) || block->length > block_size) return 0;
+
+	return block;
+}
+
+// Decodes the record at the offset into a block; returns 0 at the end
+static int block_next(const blackbox_block_t *block, size_t *offset, uint64_t *time, record_t *record)
+{
+	const uint8_t *data = (const uint8_t *)block;
+	size_t used, length = block->length;
+	uint64_t delta;
+
+	if(*offset >= length) return 0;
+
+	record->type = data[(*offset)++];
+	if(record->type == BLACKBOX_PADDING) return 0;
+
+	used = get_varint(data + *offset, length - *offset, &delta);
+	if(!used) return 0;
+	*offset += used;
+
+	*time += unzigzag(delta);
+	record->time = *time;
+	record->a = record->b = 0;
+
+	switch(record->type)
+	{
+		case BLACKBOX_TELEM:
+			if(*offset >= length) return 0;
+			record->a = data[(*offset)++];
+			used = get_varint(data + *offset, length - *offset, &record->b);
+			break;
+
+		case BLACKBOX_INPUT:
+			used = get_varint(data + *offset, length - *offset, &record->a);
+			break;
+
+		case BLACKBOX_RECORD:
+			if(*offset >= length) return 0;
+			record->a = data[*offset];
+			used = 1;
+			break;
+
+		case BLACKBOX_FRAME:
+			used = get_varint(data + *offset, length - *offset, &record->a);
+			if(!used) return 0;
+			*offset += used;
+			used = get_varint(data + *offset, length - *offset, &record->b);
+			break;
+
+		default:
+			return 0;
+	}
+
+	if(!used) return 0;
+	*offset += used;
+
+	return 1;
+}
+
+static void state_frame(state_t *state, const record_t *record)
+{
+	int64_t pts = unzigzag(record->a);
+
+	// Without encoder timestamps the frame's arrival time stands in
+	if(pts == PTS_UNKNOWN) pts = record->time;
+
+	if(!state->frames && state->recording)
+	{
+		state->frames = 1;
+		state->first_time = record->time;
+		state->first_pts = pts;
+	}
+
+	state->frame_time = record->time;
+	state->frame_pts = pts;
+}
+
+static void state_apply(state_t *state, const record_t *record)
+{
+	switch(record->type)
+	{
+		case BLACKBOX_TELEM:
+			state->snapshot.values[record->a] = record->b;
+			break;
+
+		case BLACKBOX_INPUT:
+			state->input = record->a;
+			break;
+
+		case BLACKBOX_RECORD:
+			state->recording = record->a;
+			break;
+
+		case BLACKBOX_FRAME:
+			state_frame(state, record);
+			break;
+	}
+}
+
+static int state_video_time(const state_t *state, uint64_t time, int64_t *video)
+{
+	if(!state->frames || time < state->first_time) return 0;
+
+	*video = (state->frame_pts - state->first_pts) + (int64_t)(time - state->frame_time);
+	return *video >= 0;
+}
+
+// Index of the last block starting at or before the time
+static size_t index_find(const uint8_t *data, size_t block_size, size_t blocks, uint64_t time)
+{
+	size_t low = 0, high = blocks;
+
+	while(high - low > 1)
+	{
+		size_t middle = low + (high - low) / 2;
+		const blackbox_block_t *block = block_get(data, block_size, middle);
+
+		// Torn blocks are rare; searching to their left is always safe
+		if(block && block->time <= time) low = middle;
+		else high = middle;
+	}
+
+	return low;
+}
+
+// Rebuilds the state at the start of a block by walking back only as far as
+// it takes to find every value the selected fields depend on
+static void state_seek(state_t *state, const uint8_t *data, size_t block_size, size_t index, const export_t *export)
+{
+	telem_mask_t needed = {{0}};
+	int need_input = 0, need_recording = 1, need_frame = 1;
+	int i;
+
+	for(i = 0; i < export->field_count; i++)
+	{
+		const field_t *field = export->fields[i];
+
+		if(field->kind == FIELD_INPUT) need_input = 1;
+		else if(field->kind == FIELD_RAW || field->kind == FIELD_SNAPSHOT)
+		{
+			telem_mask_set(&needed, field->id);
+			if(field->id2) telem_mask_set(&needed, field->id2);
+		}
+	}
+
+	while(index-- > 0)
+	{
+		const blackbox_block_t *block = block_get(data, block_size, index);
+		state_t latest;
+		telem_mask_t seen = {{0}};
+		int seen_input = 0, seen_recording = 0, seen_frame = 0, pending = 0;
+		size_t offset = sizeof(blackbox_block_t);
+		uint64_t time;
+		record_t record;
+
+		if(!block) continue;
+
+		// The last value of each kind in this block wins
+		memset(&latest, 0, sizeof(latest));
+		time = block->time;
+		while(block_next(block, &offset, &time, &record))
+		{
+			switch(record.type)
+			{
+				case BLACKBOX_TELEM:
+					latest.snapshot.values[record.a] = record.b;
+					telem_mask_set(&seen, record.a);
+					break;
+
+				case BLACKBOX_INPUT:
+					latest.input = record.a;
+					seen_input = 1;
+					break;
+
+				case BLACKBOX_RECORD:
+					latest.recording = record.a;
+					seen_recording = 1;
+					break;
+
+				case BLACKBOX_FRAME:
+					latest.frame_time = record.time;
+					latest.frame_pts = unzigzag(record.a);
+					if(latest.frame_pts == PTS_UNKNOWN) latest.frame_pts = record.time;
+					seen_frame = 1;
+					break;
+			}
+		}
+
+		for(i = 0; i < 8; i++)
+		{
+			uint32_t bits = needed.bits[i] & seen.bits[i];
+
+			needed.bits[i] &= ~bits;
+			while(bits)
+			{
+				uint8_t id = i * 32 + __builtin_ctz(bits);
+				bits &= bits - 1;
+
+				state->snapshot.values[id] = latest.snapshot.values[id];
+			}
+
+			pending |= needed.bits[i];
+		}
+
+		if(need_input && seen_input)
+		{
+			state->input = latest.input;
+			need_input = 0;
+		}
+
+		if(need_recording && seen_recording)
+		{
+			state->recording = latest.recording;
+			need_recording = 0;
+		}
+
+		if(need_frame && seen_frame)
+		{
+			state->frame_time = latest.frame_time;
+			state->frame_pts = latest.frame_pts;
+			need_frame = 0;
+		}
+
+		if(!pending && !need_input && !need_recording && !need_frame) break;
+	}
+}
+
+// Finds the first frame of the recording, near the start of the log
+static void state_first_frame(state_t *state, const uint8_t *data, size_t block_size, size_t blocks)
+{
+	state_t scan;
+	size_t index;
+
+	memset(&scan, 0, sizeof(scan));
+	for(index = 0; index < blocks && !scan.frames; index++)
+	{
+		const blackbox_block_t *block = block_get(data, block_size, index);
+		size_t offset = sizeof(blackbox_block_t);
+		uint64_t time;
+		record_t record;
+
+		if(!block) continue;
+
+		time = block->time;
+		while(!scan.frames && block_next(block, &offset, &time, &record))
+		{
+			if(record.type == BLACKBOX_RECORD) scan.recording = record.a;
+			else if(record.type == BLACKBOX_FRAME) state_frame(&scan, &record);
+		}
+	}
+
+	state->frames = scan.frames;
+	state->first_time = scan.first_time;
+	state->first_pts = scan.first_pts;
+}
+
+static void export_begin(const export_t *export)
+{
+	int i;
+
+	switch(export->format)
+	{
+		case FORMAT_CSV:
+			printf("time,video");
+			for(i = 0; i < export->field_count; i++)
+				printf(",%s", export->fields[i]->name);
+			printf("\n");
+			break;
+
+		case FORMAT_JSON:
+			printf("[");
+			break;
+	}
+}
+
+// Writes out the queued row, which lasts until the end time (or end video
+// time, if the video is known by then)
+static void export_flush(export_t *export, uint64_t end, int64_t end_video)
+{
+	int i;
+
+	if(!export->pending) return;
+	export->pending = 0;
+
+	switch(export->format)
+	{
+		case FORMAT_CSV:
+			print_seconds(export->pending_time - export->start_time);
+			printf(",");
+			if(export->pending_video >= 0) print_seconds(export->pending_video);
+			for(i = 0; i < export->field_count; i++)
+			{
+				printf(",");
+				print_value(export->pending_values[i], export->fields[i]->divisor);
+			}
+			printf("\n");
+			break;
+
+		case FORMAT_JSON:
+			printf("%s\n{\"time\":", export->rows ? "," : "");
+			print_seconds(export->pending_time - export->start_time);
+			printf(",\"video\":");
+			if(export->pending_video >= 0) print_seconds(export->pending_video);
+			else printf("null");
+			for(i = 0; i < export->field_count; i++)
+			{
+				printf(",\"%s\":", export->fields[i]->name);
+				print_value(export->pending_values[i], export->fields[i]->divisor);
+			}
+			printf("}");
+			break;
+
+		case FORMAT_SRT:
+			// Subtitles only cover the video
+			if(export->pending_video < 0) return;
+
+			printf("%u\n", export->rows + 1);
+			print_srt_time(export->pending_video);
+			printf(" --> ");
+			if(end_video < 0) end_video = export->pending_video + (end - export->pending_time);
+			print_srt_time(end_video);
+			printf("\n");
+			for(i = 0; i < export->field_count; i++)
+			{
+				printf("%s%s ", i ? "  " : "", export->fields[i]->name);
+				print_value(export->pending_values[i], export->fields[i]->divisor);
+				printf("%s", export->fields[i]->unit);
+			}
+			printf("\n\n");
+			break;
+	}
+
+	export->rows++;
+}
+
+static void export_end(export_t *export, uint64_t end)
+{
+	export_flush(export, end, -1);
+
+	if(export->format == FORMAT_JSON)
+		printf("\n]\n");
+}
+
+// Queues a row if it differs from the last, first writing out the previous
+static void export_row(export_t *export, const state_t *state, uint64_t time, int force)
+{
+	int32_t values[FIELDS_MAX];
+	int64_t video;
+	int i, changed = force || (!export->pending && !export->rows);
+
+	for(i = 0; i < export->field_count; i++)
+	{
+		values[i] = field_value(export->fields[i], state);
+		if(values[i] != export->pending_values[i]) changed = 1;
+	}
+
+	if(!changed) return;
+
+	if(!state_video_time(state, time, &video)) video = -1;
+
+	// Records logged in the same microsecond make one row
+	if(!export->pending || export->pending_time != time)
+		export_flush(export, time, video);
+
+	export->pending = 1;
+	export->pending_time = time;
+	export->pending_video = video;
+	memcpy(export->pending_values, values, sizeof(int32_t) * export->field_count);
+}
+
+static void export_list(const uint8_t *data, size_t block_size, size_t blocks, const blackbox_header_t *header)
+{
+	uint32_t counts[256] = {0}, types[5] = {0};
+	uint64_t last = header->start_time;
+	size_t index, torn = 0;
+	time_t wall = header->wall_time / 1000000;
+	char date[64];
+	int id;
+
+	for(index = 0; index < blocks; index++)
+	{
+		const blackbox_block_t *block = block_get(data, block_size, index);
+		size_t offset = sizeof(blackbox_block_t);
+		uint64_t time;
+		record_t record;
+
+		if(!block)
+		{
+			torn++;
+			continue;
+		}
+
+		time = block->time;
+		while(block_next(block, &offset, &time, &record))
+		{
+			types[record.type]++;
+			if(record.type == BLACKBOX_TELEM) counts[record.a]++;
+			if(time > last) last = time;
+		}
+	}
+
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&wall));
+
+	printf("started      %s\n", date);
+	printf("duration     ");
+	print_seconds(last - header->start_time);
+	printf(" s\n");
+	printf("blocks       %zu (%zu torn)\n", blocks, torn);
+	printf("records      %u telemetry, %u input, %u frames\n", types[BLACKBOX_TELEM], types[BLACKBOX_INPUT], types[BLACKBOX_FRAME]);
+
+	printf("\n id   records  name\n");
+	for(id = 0; id < 256; id++)
+	{
+		unsigned int i;
+		const char *name = "";
+
+		if(!counts[id]) continue;
+
+		for(i = 0; i < FIELDS; i++)
+			if(_fields[i].kind == FIELD_RAW && _fields[i].id == id) name = _fields[i].name;
+		if(id >= TELEM_ID_CHANNEL && id < TELEM_ID_CHANNEL + TELEM_CHANNELS) name = "channel";
+
+		printf("0x%02x %8u  %s\n", id, counts[id], name);
+	}
+}
+
+static void usage(const char *name)
+{
+	unsigned int i;
+
+	fprintf(stderr,
+		"Usage: %s [-c | -j | -S] [-f fields] [-s start] [-e end] [-t interval] log\n"
+		"       %s -l log\n"
+		"  -c  write CSV (default)\n"
+		"  -j  write JSON\n"
+		"  -S  write SRT subtitles timed to the recording\n"
+		"  -f  comma-separated fields (default %s)\n"
+		"  -s  start, in seconds from the start of the log\n"
+		"  -e  end, in seconds from the start of the log\n"
+		"  -t  write a row every interval milliseconds instead of on each change\n"
+		"      (subtitles default to every %d ms)\n"
+		"  -l  list the log's duration and the telemetry IDs it holds\n"
+		"\nFields:", name, name, _default_fields, SRT_INTERVAL / 1000);
+
+	for(i = 0; i < FIELDS; i++)
+		fprintf(stderr, "%s %s", i % 8 ? "" : "\n ", _fields[i].name);
+
+	fprintf(stderr, "\n  ch1 to ch%d, or any telemetry ID as a number\n", TELEM_CHANNELS);
+}
+
+int main(int argc, char **argv)
+{
+	const char *error = 0, *fields = _default_fields;
+	int option, list = 0;
+	double start = 0, end = -1;
+
+	int fd = -1;
+	uint8_t *data = MAP_FAILED;
+	size_t length = 0, blocks = 0, block_size;
+
+	blackbox_header_t header;
+	export_t export;
+	state_t state;
+
+	memset(&export, 0, sizeof(export));
+	memset(&state, 0, sizeof(state));
+
+	while((option = getopt(argc, argv, "ce:f:jls:St:")) != -1)
+	{
+		switch(option)
+		{
+			case 'c':
+				export.format = FORMAT_CSV;
+				break;
+
+			case 'e':
+				end = atof(optarg);
+				break;
+
+			case 'f':
+				fields = optarg;
+				break;
+
+			case 'j':
+				export.format = FORMAT_JSON;
+				break;
+
+			case 'l':
+				list = 1;
+				break;
+
+			case 's':
+				start = atof(optarg);
+				break;
+
+			case 'S':
+				export.format = FORMAT_SRT;
+				break;
+
+			case 't':
+				export.interval = atoi(optarg) * 1000ull;
+				break;
+
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if(optind != argc - 1 || start < 0)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	// Parse the field list
+	{
+		char *copy = strdup(fields), *name, *save;
+
+		for(name = strtok_r(copy, ",", &save); name; name = strtok_r(0, ",", &save))
+		{
+			const field_t *field = field_find(name);
+
+			if(!field || export.field_count == FIELDS_MAX)
+			{
+				fprintf(stderr, "Unknown field: %s\n", name);
+				free(copy);
+				usage(argv[0]);
+				return 1;
+			}
+
+			export.fields[export.field_count++] = field;
+		}
+
+		free(copy);
+	}
+
+	// Map the log
+	{
+		struct stat st;
+
+		fd = open(argv[optind], O_RDONLY);
+		if(fd < 0 || fstat(fd, &st))
+		{
+			error = "Failed to open log.";
+			goto cleanup;
+		}
+
+		length = st.st_size;
+		if(length)
+			data = mmap(0, length, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if(data == MAP_FAILED)
+		{
+			error = "Failed to map log.";
+			goto cleanup;
+		}
+
+		madvise(data, length, MADV_SEQUENTIAL);
+	}
+
+	if(length >= sizeof(header))
+		memcpy(&header, data, sizeof(header));
+
+	if(length < sizeof(header) || header.magic != BLACKBOX_MAGIC || header.version != BLACKBOX_VERSION)
+	{
+		error = "Not a flight log.";
+		goto cleanup;
+	}
+
+	block_size = header.block_size;
+	if(block_size < sizeof(blackbox_block_t) || block_size % 8)
+	{
+		error = "Bad block size.";
+		goto cleanup;
+	}
+
+	blocks = length / block_size;
+	if(blocks) blocks--;
+
+	if(list)
+	{
+		export_list(data, block_size, blocks, &header);
+		goto cleanup;
+	}
+
+	// Export
+	{
+		uint64_t from = header.start_time + (uint64_t)(start * 1e6);
+		uint64_t to = end < 0 ? UINT64_MAX : header.start_time + (uint64_t)(end * 1e6);
+		uint64_t time = from, sample = from;
+		size_t index = index_find(data, block_size, blocks, from);
+		int started = 0, done = 0;
+
+		export.start_time = header.start_time;
+		if(export.format == FORMAT_SRT && !export.interval)
+			export.interval = SRT_INTERVAL;
+
+		state_first_frame(&state, data, block_size, blocks);
+		state_seek(&state, data, block_size, index, &export);
+
+		export_begin(&export);
+
+		for(; index < blocks && !done; index++)
+		{
+			const blackbox_block_t *block = block_get(data, block_size, index);
+			size_t offset = sizeof(blackbox_block_t);
+			uint64_t record_time;
+			record_t record;
+
+			if(!block) continue;
+
+			record_time = block->time;
+			while(block_next(block, &offset, &record_time, &record))
+			{
+				if(record.time > to)
+				{
+					done = 1;
+					break;
+				}
+
+				if(record.time >= from)
+				{
+					// A range starting mid-log opens with the state at its start
+					if(!started)
+					{
+						if(from > header.start_time || export.interval)
+							export_row(&export, &state, from, 1);
+						sample = from + export.interval;
+						started = 1;
+					}
+
+					if(export.interval)
+					{
+						for(; sample < record.time; sample += export.interval)
+							export_row(&export, &state, sample, 1);
+					}
+
+					time = record.time;
+				}
+
+				state_apply(&state, &record);
+
+				if(started && !export.interval)
+					export_row(&export, &state, record.time, 0);
+			}
+		}
+
+		if(started && export.interval && to != UINT64_MAX)
+		{
+			for(; sample <= to; sample += export.interval)
+				export_row(&export, &state, sample, 1);
+			time = to;
+		}
+
+		export_end(&export, to == UINT64_MAX ? time + export.interval : to);
+	}
+
+cleanup:
+	if(data != MAP_FAILED) munmap(data, length);
+	if(fd >= 0) close(fd);
+
+	if(error)
+	{
+		fprintf(stderr, "Fatal error: %s\n", error);
+		return 1;
+	}
+
+	return 0;
+}
@@ -1,7 +1,15 @@
 #include "cam.h"
 
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <interface/mmal/mmal.h>
@@ -11,6 +19,10 @@
 #include <interface/mmal/util/mmal_util_params.h>
 #include <interface/vcos/vcos.h>
 
+#include "frame_index.h"
+#include "mp4.h"
+#include "writer.h"
+
 #define CAM_AWB_B_DEN 1
 #define CAM_AWB_B_NUM 1
 #define CAM_AWB_MODE MMAL_PARAM_AWBMODE_AUTO
@@ -44,6 +56,61 @@
 #define VID_FRAMERATE_NUM 30
 #define VID_QUALITY 20
 
+// Encoded data waiting for the writer thread: about 4 s at 16 Mbit/s (bytes)
+#define VID_WRITE_BUFFER (8 * 1024 * 1024)
+
+// A recording rolls over to a new file at the first keyframe past either
+// limit, so a power cut can only damage the segment being written, and files
+// stay quick to copy (seconds, bytes)
+#define VID_SEGMENT_DURATION 60
+#define VID_SEGMENT_SIZE (256 * 1024 * 1024)
+
+// Interval between fdatasync calls on the segment being written, or 0 to sync
+// only when a segment closes (microseconds)
+#define VID_SYNC_INTERVAL 1000000
+
+// Seconds of video kept from before recording starts, or 0 to run the encoder
+// only while recording. With it set, the encoder runs all the time with a
+// keyframe every second, and the buffer caps the memory the seconds take
+// (bytes), losing the oldest first. The buffer must fit in the writer's.
+#define VID_PRERECORD 0
+#define VID_PRERECORD_BUFFER (4 * 1024 * 1024)
+#define VID_PRERECORD_KEYFRAMES 64
+
+// Frame intervals the running encoder gets to pick up a stop request before
+// the recording is closed without it
+#define VID_STOP_FRAMES 5
+
+// Room for the SPS and PPS the encoder sends once when it starts
+#define VID_HEADER_MAX 256
+
+// Set to record fragmented MP4, or 0 for a raw H.264 stream. Each keyframe
+// interval is held in the fragment buffer and written as one fragment, or as
+// several if it doesn't fit (bytes).
+#define VID_MP4 1
+#define VID_FRAGMENT_BUFFER (2 * 1024 * 1024)
+
+// With a raw stream, each segment gets an index of its frames; entries wait
+// here for their own writer thread (bytes)
+#define VID_INDEX_BUFFER (256 * 1024)
+
+#if VID_PRERECORD && !VID_MP4 && VID_PRERECORD_BUFFER + VID_HEADER_MAX > VID_WRITE_BUFFER
+#error The pre-record buffer must fit in the writer buffer.
+#endif
+
+#if VID_MP4 && VID_FRAGMENT_BUFFER * 2 > VID_WRITE_BUFFER
+#error The fragment buffer must fit in the writer buffer twice.
+#endif
+
+// Recording state, moved on by the encoder callback at frame boundaries
+enum
+{
+	CAM_IDLE,
+	CAM_STARTING,
+	CAM_RECORDING,
+	CAM_STOPPING,
+};
+
 struct cam
 {
 	MMAL_COMPONENT_T *camera_component;
@@ -63,7 +130,87 @@ struct cam
 	MMAL_PORT_T *encoder_out_port;
 	MMAL_PORT_T *preview_in_port;
 
-	FILE *file;
+	// The encoder callback copies into the writer and hands its buffer straight
+	// back. After the writer overflows, it skips to the next keyframe, so the
+	// gap in the file is whole frames.
+	writer_t writer;
+	atomic_int state;
+	int skipping;
+	int frame_start;
+
+	// Where the segment being written started, and its length so far. No
+	// segment is open until the first keyframe.
+	int segment_open;
+	int64_t segment_pts;
+	uint64_t segment_bytes;
+
+	// Frame boundaries and timing of what goes to the file, which lags the
+	// encoder while the pre-record buffer is replayed
+	int output_frame_start;
+	int output_keyframe;
+	int64_t output_pts;
+
+	// Without VID_MP4, the frame index, and where the frame being written
+	// starts in its segment
+	writer_t index;
+	uint64_t output_offset;
+
+	// With VID_MP4, frames are gathered here until their fragment goes out.
+	// After a frame is lost, the muxer skips to the next keyframe.
+	mp4_t mp4;
+	int mux_skipping;
+
+	uint8_t header[VID_HEADER_MAX];
+	size_t header_length;
+
+	// Encoder buffers from before recording starts, owned by the encoder
+	// callback. Byte positions run freely and wrap through the buffer; the
+	// index holds where each keyframe in it starts, oldest first, and the data
+	// always starts with the oldest.
+	struct
+	{
+		uint8_t *data;
+		uint64_t head;
+		uint64_t tail;
+		struct
+		{
+			uint64_t position;
+			int64_t pts;
+		} keyframes[VID_PRERECORD_KEYFRAMES];
+		unsigned int first;
+		unsigned int count;
+	} prerecord;
+
+	// Last completed frame, written by the encoder callback under a sequence
+	// lock so the main thread can map PTS to CLOCK_MONOTONIC
+	atomic_uint frame_sequence;
+	struct
+	{
+		uint64_t time;
+		int64_t pts;
+		uint32_t flags;
+	} frame;
+
+	// Signalled for each frame, so the main thread can sleep until one arrives
+	int frame_fd;
+
+	// SCHED_FIFO priority of the MMAL thread that runs the encoder callback, or
+	// 0 for the default. Only the callback knows its thread, so it applies it.
+	atomic_int priority;
+	int priority_applied;
+};
+
+// Exposure profiles chosen by the profile switch: as configured, bright
+// scenes, low light
+static const struct
+{
+	MMAL_PARAM_EXPOSUREMODE_T exposure_mode;
+	int32_t exposure_compensation;
+	MMAL_PARAMETER_DRC_STRENGTH_T drc;
+} _profiles[CAM_PROFILES] = {
+	{CAM_EXPOSURE_MODE, CAM_EXPOSURE_COMPENSATION, CAM_DRC},
+	{CAM_EXPOSURE_MODE, -6, MMAL_PARAMETER_DRC_STRENGTH_OFF},
+	{MMAL_PARAM_EXPOSUREMODE_NIGHT, 6, MMAL_PARAMETER_DRC_STRENGTH_HIGH},
 };
 
 static const char *_error;
@@ -145,20 +292,370 @@ void cam_deinit(cam_t cam)
 	cam_deinit_preview(cam);
 	cam_deinit_camera(cam);
 
-	if(cam->file) fclose(cam->file);
+	if(cam->writer) writer_deinit(cam->writer);
+	if(cam->mp4) mp4_deinit(cam->mp4);
+	if(cam->index) writer_deinit(cam->index);
+	free(cam->prerecord.data);
+	if(cam->frame_fd >= 0) close(cam->frame_fd);
 
 	free(cam);
 }
 
+static uint64_t cam_now(void)
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000 + ((uint64_t)time.tv_nsec + 500) / 1000;
+}
+
+static void cam_publish_frame(cam_t cam, MMAL_BUFFER_HEADER_T *buffer)
+{
+	unsigned int sequence = atomic_load_explicit(&cam->frame_sequence, memory_order_relaxed);
+
+	atomic_store_explicit(&cam->frame_sequence, sequence + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	cam->frame.time = cam_now();
+	cam->frame.pts = buffer->pts;
+	cam->frame.flags = buffer->flags;
+
+	atomic_store_explicit(&cam->frame_sequence, sequence + 2, memory_order_release);
+
+	eventfd_write(cam->frame_fd, 1);
+}
+
+int cam_frame_fd(cam_t cam)
+{
+	return cam->frame_fd;
+}
+
+unsigned int cam_last_frame(cam_t cam, uint64_t *time, int64_t *pts, uint32_t *flags)
+{
+	unsigned int begin, end;
+
+	while(1)
+	{
+		begin = atomic_load_explicit(&cam->frame_sequence, memory_order_acquire);
+		if(begin & 1) continue;
+
+		*time = cam->frame.time;
+		*pts = cam->frame.pts;
+		*flags = cam->frame.flags;
+
+		atomic_thread_fence(memory_order_acquire);
+		end = atomic_load_explicit(&cam->frame_sequence, memory_order_relaxed);
+		if(begin == end) return begin / 2;
+	}
+}
+
+static void cam_write(cam_t cam, const uint8_t *data, size_t length, int keyframe)
+{
+	if(cam->skipping && keyframe) cam->skipping = 0;
+	if(!cam->skipping) cam->skipping = writer_write(cam->writer, data, length);
+	if(!cam->skipping) cam->segment_bytes += length;
+}
+
+// Writes the whole frames gathered as one fragment, or drops all of it when
+// the writer is full, skipping fragments after that until one starts with a
+// keyframe
+static void cam_fragment(cam_t cam, int64_t next_pts)
+{
+	mp4_fragment_t fragment;
+	struct iovec parts[2];
+
+	if(mp4_fragment(cam->mp4, next_pts == MMAL_TIME_UNKNOWN ? INT64_MIN : next_pts, &fragment)) return;
+
+	parts[0].iov_base = (void *)fragment.header;
+	parts[0].iov_len = fragment.header_length;
+	parts[1].iov_base = (void *)fragment.payload;
+	parts[1].iov_len = fragment.payload_length;
+
+	if(cam->skipping && fragment.keyframe) cam->skipping = 0;
+	if(!cam->skipping) cam->skipping = writer_writev(cam->writer, parts, 2);
+	if(!cam->skipping) cam->segment_bytes += fragment.header_length + fragment.payload_length;
+
+	mp4_release(cam->mp4);
+}
+
+// Adds a buffer to the frame being muxed. A keyframe interval too long for the
+// fragment buffer goes out in more than one fragment, and a frame too big for
+// it on its own is lost.
+static void cam_mux(cam_t cam, const uint8_t *data, size_t length, uint32_t flags)
+{
+	if(cam->output_frame_start && cam->output_keyframe) cam->mux_skipping = 0;
+	if(cam->mux_skipping) return;
+
+	if(mp4_append(cam->mp4, data, length))
+	{
+		cam_fragment(cam, MMAL_TIME_UNKNOWN);
+		if(mp4_append(cam->mp4, data, length)) goto drop;
+	}
+
+	if(!(flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)) return;
+
+	if(mp4_frame(cam->mp4, cam->output_pts, cam->output_keyframe))
+	{
+		cam_fragment(cam, cam->output_pts);
+		if(mp4_frame(cam->mp4, cam->output_pts, cam->output_keyframe)) goto drop;
+	}
+
+	return;
+
+drop:
+	mp4_discard(cam->mp4);
+	cam->mux_skipping = 1;
+}
+
+// Called at each keyframe; opens the first segment, and rolls over to a new
+// one once the one being written is long enough. Each starts with the stream
+// header.
+static void cam_segment(cam_t cam)
+{
+	const uint8_t *header = cam->header;
+	size_t length = cam->header_length;
+
+	if(cam->segment_open)
+	{
+		if(cam->segment_bytes < VID_SEGMENT_SIZE && cam->output_pts - cam->segment_pts < VID_SEGMENT_DURATION * 1000000LL)
+			return;
+
+		// The video and its index roll over together or not at all, so the
+		// segment numbers of the two files stay in step
+		if(!writer_split_ready(cam->writer) || (!VID_MP4 && !writer_split_ready(cam->index)))
+			return;
+
+		writer_split(cam->writer);
+		if(!VID_MP4) writer_split(cam->index);
+	}
+
+	if(VID_MP4) length = mp4_header(cam->mp4, &header);
+	else
+	{
+		frame_index_header_t index = {FRAME_INDEX_MAGIC, FRAME_INDEX_VERSION, sizeof(frame_index_entry_t)};
+		writer_write(cam->index, &index, sizeof(index));
+	}
+
+	cam->segment_open = 1;
+	cam->segment_pts = cam->output_pts;
+	cam->segment_bytes = 0;
+	cam_write(cam, header, length, 1);
+}
+
+// Adds the frame just written to the segment's index, unless part of it was
+// dropped
+static void cam_index(cam_t cam)
+{
+	frame_index_entry_t entry;
+
+	if(cam->skipping) return;
+
+	entry.offset = cam->output_offset;
+	entry.pts = cam->output_pts;
+	entry.size = cam->segment_bytes - cam->output_offset;
+	entry.flags = cam->output_keyframe ? FRAME_INDEX_KEYFRAME : 0;
+	writer_write(cam->index, &entry, sizeof(entry));
+}
+
+// Everything bound for the file comes through here, live or replayed from the
+// pre-record buffer. Frames without a PTS are timed from the one before.
+static void cam_output(cam_t cam, const uint8_t *data, size_t length, uint32_t flags, int64_t pts)
+{
+	if(cam->output_frame_start)
+	{
+		cam->output_keyframe = (flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME) != 0;
+		cam->output_pts = pts != MMAL_TIME_UNKNOWN ? pts : cam->output_pts + 1000000LL * VID_FRAMERATE_DEN / VID_FRAMERATE_NUM;
+
+		// The keyframe interval before goes out as a fragment, in the segment
+		// it belongs to
+		if(cam->output_keyframe)
+		{
+			if(VID_MP4) cam_fragment(cam, cam->output_pts);
+			cam_segment(cam);
+		}
+	}
+
+	// Nothing goes out before the first keyframe
+	if(cam->segment_open)
+	{
+		if(VID_MP4) cam_mux(cam, data, length, flags);
+		else
+		{
+			if(cam->output_frame_start) cam->output_offset = cam->segment_bytes;
+			cam_write(cam, data, length, cam->output_frame_start && cam->output_keyframe);
+			if(flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) cam_index(cam);
+		}
+	}
+
+	cam->output_frame_start = (flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) != 0;
+}
+
+// Writes out the last frames when recording stops
+static void cam_finish(cam_t cam)
+{
+	if(VID_MP4 && cam->segment_open) cam_fragment(cam, MMAL_TIME_UNKNOWN);
+}
+
+// Each buffer held for pre-recording is a record of its header and data,
+// padded to keep records aligned. Records don't wrap; the space left at the
+// end of the buffer is skipped, and marked as such if a record fits in it.
+typedef struct
+{
+	uint32_t length;
+	uint32_t flags;
+	int64_t pts;
+} cam_record_t;
+
+#define CAM_RECORD_SKIP UINT32_MAX
+
+static void cam_prerecord_drop(cam_t cam)
+{
+	cam->prerecord.first = (cam->prerecord.first + 1) % VID_PRERECORD_KEYFRAMES;
+	cam->prerecord.count--;
+	cam->prerecord.tail = cam->prerecord.keyframes[cam->prerecord.first].position;
+}
+
+static void cam_prerecord(cam_t cam, MMAL_BUFFER_HEADER_T *buffer)
+{
+	uint64_t head = cam->prerecord.head;
+	size_t offset = head % VID_PRERECORD_BUFFER;
+	size_t length = (sizeof(cam_record_t) + buffer->length + 7) & ~(size_t)7;
+	size_t skip = VID_PRERECORD_BUFFER - offset < length ? VID_PRERECORD_BUFFER - offset : 0;
+	cam_record_t *record;
+
+	if(!cam->prerecord.data) return;
+
+	if(cam->frame_start && (buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME))
+	{
+		unsigned int i;
+
+		if(cam->prerecord.count == VID_PRERECORD_KEYFRAMES) cam_prerecord_drop(cam);
+		if(!cam->prerecord.count) cam->prerecord.tail = head;
+
+		i = (cam->prerecord.first + cam->prerecord.count) % VID_PRERECORD_KEYFRAMES;
+		cam->prerecord.keyframes[i].position = head;
+		cam->prerecord.keyframes[i].pts = buffer->pts;
+		cam->prerecord.count++;
+
+		// A keyframe goes once the one after it is old enough to start from
+		while(cam->prerecord.count > 1 && buffer->pts != MMAL_TIME_UNKNOWN &&
+			cam->prerecord.keyframes[(cam->prerecord.first + 1) % VID_PRERECORD_KEYFRAMES].pts <= buffer->pts - VID_PRERECORD * 1000000LL)
+			cam_prerecord_drop(cam);
+	}
+
+	// Nothing is kept until there is a keyframe to start from
+	if(!cam->prerecord.count) return;
+
+	while(skip + length > VID_PRERECORD_BUFFER - (head - cam->prerecord.tail))
+	{
+		// A single keyframe interval that doesn't fit is lost whole
+		if(cam->prerecord.count == 1)
+		{
+			cam->prerecord.count = 0;
+			cam->prerecord.tail = head;
+			return;
+		}
+
+		cam_prerecord_drop(cam);
+	}
+
+	if(skip)
+	{
+		if(skip >= sizeof(cam_record_t)) ((cam_record_t *)(cam->prerecord.data + offset))->length = CAM_RECORD_SKIP;
+		head += skip;
+		offset = 0;
+	}
+
+	record = (cam_record_t *)(cam->prerecord.data + offset);
+	record->length = buffer->length;
+	record->flags = buffer->flags;
+	record->pts = buffer->pts;
+	memcpy(record + 1, buffer->data, buffer->length);
+	cam->prerecord.head = head + length;
+}
+
+// Replays everything from the oldest keyframe held into the recording, which
+// starts there. With nothing held, it starts at the next keyframe.
+static void cam_prerecord_flush(cam_t cam)
+{
+	uint64_t position = cam->prerecord.tail;
+
+	while(cam->prerecord.count && position != cam->prerecord.head)
+	{
+		size_t offset = position % VID_PRERECORD_BUFFER;
+		cam_record_t *record = (cam_record_t *)(cam->prerecord.data + offset);
+
+		if(VID_PRERECORD_BUFFER - offset < sizeof(cam_record_t) || record->length == CAM_RECORD_SKIP)
+		{
+			position += VID_PRERECORD_BUFFER - offset;
+			continue;
+		}
+
+		cam_output(cam, (const uint8_t *)(record + 1), record->length, record->flags, record->pts);
+		position += (sizeof(cam_record_t) + record->length + 7) & ~(size_t)7;
+	}
+
+	cam->prerecord.count = 0;
+	cam->prerecord.tail = cam->prerecord.head;
+}
+
 static void cam_callback_encoder_out(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
 {
 	cam_t cam = (cam_t)port->userdata;
 	MMAL_BUFFER_HEADER_T *new_buffer;
 	MMAL_STATUS_T status;
+	int state = atomic_load(&cam->state);
+	int priority = atomic_load_explicit(&cam->priority, memory_order_relaxed);
+
+	if(priority != cam->priority_applied)
+	{
+		struct sched_param param = {.sched_priority = priority};
+
+		if(pthread_setschedparam(pthread_self(), priority ? SCHED_FIFO : SCHED_OTHER, &param))
+			fprintf(stderr, "WARNING: Failed to set the encoder thread's priority.\n");
+		cam->priority_applied = priority;
+	}
+
+	if(buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)
+		cam_publish_frame(cam, buffer);
+
+	if(cam->frame_start)
+	{
+		if(state == CAM_STARTING)
+		{
+			cam_prerecord_flush(cam);
+			state = CAM_RECORDING;
+			atomic_store(&cam->state, state);
+		}
+		else if(state == CAM_STOPPING)
+		{
+			cam_finish(cam);
+			state = CAM_IDLE;
+			atomic_store(&cam->state, state);
+		}
+	}
 
 	mmal_buffer_header_mem_lock(buffer);
-	fwrite(buffer->data, 1, buffer->length, cam->file);
+
+	// The header only goes out at the start of each segment
+	if(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG)
+	{
+		if(buffer->length <= VID_HEADER_MAX)
+		{
+			memcpy(cam->header, buffer->data, buffer->length);
+			cam->header_length = buffer->length;
+		}
+
+		if(VID_MP4 && mp4_config(cam->mp4, buffer->data, buffer->length))
+			fprintf(stderr, "WARNING: %s\n", mp4_error());
+	}
+	else if(state == CAM_RECORDING || state == CAM_STOPPING)
+		cam_output(cam, buffer->data, buffer->length, buffer->flags, buffer->pts);
+	else
+		cam_prerecord(cam, buffer);
+
 	mmal_buffer_header_mem_unlock(buffer);
+
+	cam->frame_start = (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) != 0;
 	mmal_buffer_header_release(buffer);
 
 	if(port->is_enabled)
@@ -550,6 +1047,18 @@ static int cam_init_encoder(cam_t cam)
 		}
 	}
 
+	// Keyframes every second, so the pre-record buffer always has one to start
+	// from
+	if(VID_PRERECORD)
+	{
+		status = mmal_port_parameter_set_uint32(cam->encoder_out_port, MMAL_PARAMETER_INTRAPERIOD, VID_FRAMERATE_NUM / VID_FRAMERATE_DEN);
+		if(status != MMAL_SUCCESS)
+		{
+			_error = "Failed to set the keyframe period.";
+			goto error;
+		}
+	}
+
 	// Enable the encoder
 	{
 		status = mmal_component_enable(cam->encoder_component);
@@ -649,6 +1158,122 @@ error:
 	return 1;
 }
 
+static int cam_run_encoder(cam_t cam)
+{
+	MMAL_STATUS_T status;
+
+	cam->frame_start = 1;
+
+	// Enable the connection from the camera to the encoder
+	{
+		status = mmal_connection_enable(cam->encoder_connection);
+		if(status != MMAL_SUCCESS)
+		{
+			_error = "Failed to enable connection from camera to encoder.";
+			goto error;
+		}
+	}
+
+	// Enable the encoder's output port
+	{
+		cam->encoder_out_port->userdata = (struct MMAL_PORT_USERDATA_T *)cam;		
+
+		status = mmal_port_enable(cam->encoder_out_port, &cam_callback_encoder_out);
+		if(status != MMAL_SUCCESS)
+		{
+			_error = "Failed to enable encoder output port.";
+			return 1;
+		}
+	}
+
+	// Request a keyframe
+	{
+		status = mmal_port_parameter_set_boolean(cam->encoder_out_port, MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME, 1);
+		if(status != MMAL_SUCCESS)
+		{
+			_error = "Failed to request a keyframe.";
+			goto error;
+		}
+	}
+
+	// Feed the encoder's output port
+	{
+		MMAL_BUFFER_HEADER_T *buffer;
+		while(buffer = mmal_queue_get(cam->output_pool->queue))
+		{
+			status = mmal_port_send_buffer(cam->encoder_out_port, buffer);
+			if(status != MMAL_SUCCESS)
+			{
+				_error = "Failed to send buffer to encoder input port.";
+				return 1;
+			}
+		}
+	}
+
+	// Start capturing on the camera video port
+	{
+		status = mmal_port_parameter_set_boolean(cam->camera_video_port, MMAL_PARAMETER_CAPTURE, 1);
+		if(status != MMAL_SUCCESS)
+		{
+			_error = "Failed to start capturing on the camera video port.";
+			goto error;
+		}
+	}
+
+	return 0;
+
+error:
+	if(cam->encoder_out_port->is_enabled)
+	{
+		mmal_port_disable(cam->encoder_out_port);
+	}
+
+	return 1;
+}
+
+static int cam_halt_encoder(cam_t cam)
+{
+	MMAL_STATUS_T status;
+
+	// Stop capturing on the camera video port
+	{
+		status = mmal_port_parameter_set_boolean(cam->camera_video_port, MMAL_PARAMETER_CAPTURE, 0);
+		if(status != MMAL_SUCCESS)
+		{
+			_error = "Failed to stop capturing on the camera video port.";
+			return 1;
+		}
+	}
+
+	// Disable the connection from splitter to encoder
+	{
+		status = mmal_connection_disable(cam->encoder_connection);
+		if(status != MMAL_SUCCESS)
+		{
+			_error = "Failed to disable connection from splitter to encoder.";
+			return 1;
+		}
+	}
+
+	// Disable the encoder's output port
+	{
+		status = mmal_port_disable(cam->encoder_out_port);
+		if(status != MMAL_SUCCESS)
+		{
+			_error = "Failed to disable encoder output port.";
+			return 1;
+		}
+	}
+
+	// Wait for encoder to flush
+	{
+		unsigned int expected = cam->encoder_out_port->buffer_num;
+		while(mmal_queue_length(cam->output_pool->queue) < expected);
+	}
+
+	return 0;
+}
+
 cam_t cam_init()
 {
 	cam_t cam = 0;
@@ -661,6 +1286,50 @@ cam_t cam_init()
 		_error = "Failed to allocate memory for camera object.";
 		goto error;
 	}
+	memset(cam, 0, sizeof(struct cam));
+
+	cam->frame_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if(cam->frame_fd < 0)
+	{
+		_error = "Failed to create frame event.";
+		goto error;
+	}
+
+	cam->writer = writer_init(VID_WRITE_BUFFER, VID_SYNC_INTERVAL);
+	if(!cam->writer)
+	{
+		_error = writer_error();
+		goto error;
+	}
+
+	if(VID_MP4)
+	{
+		cam->mp4 = mp4_init(VID_FRAGMENT_BUFFER, CAM_WIDTH, CAM_HEIGHT);
+		if(!cam->mp4)
+		{
+			_error = mp4_error();
+			goto error;
+		}
+	}
+	else
+	{
+		cam->index = writer_init(VID_INDEX_BUFFER, 0);
+		if(!cam->index)
+		{
+			_error = writer_error();
+			goto error;
+		}
+	}
+
+	if(VID_PRERECORD)
+	{
+		cam->prerecord.data = malloc(VID_PRERECORD_BUFFER);
+		if(!cam->prerecord.data)
+		{
+			_error = "Failed to allocate pre-record buffer.";
+			goto error;
+		}
+	}
 
 	// Create the camera
 	result = cam_init_camera(cam);
@@ -738,6 +1407,13 @@ cam_t cam_init()
 		}
 	}
 
+	// Pre-recording keeps the encoder running from the start
+	if(VID_PRERECORD)
+	{
+		result = cam_run_encoder(cam);
+		if(result) goto error;
+	}
+
 	return cam;
 
 error:
@@ -747,105 +1423,135 @@ error:
 
 int cam_recording(cam_t cam)
 {
-	return cam->file != 0;
+	return atomic_load(&cam->state) != CAM_IDLE;
 }
 
-int cam_start(cam_t cam, const char *path)
+int cam_set_priority(cam_t cam, int priority)
+{
+	if(cam_recording(cam))
+	{
+		_error = "Camera is recording.";
+		return 1;
+	}
+
+	atomic_store_explicit(&cam->priority, priority, memory_order_relaxed);
+	return 0;
+}
+
+int cam_set_profile(cam_t cam, unsigned int profile)
 {
 	MMAL_STATUS_T status;
 
-	if(cam_recording(cam))
+	if(profile >= CAM_PROFILES)
 	{
-		_error = "Camera is already recording.";
+		_error = "Invalid camera profile.";
 		return 1;
 	}
 
-	// Open the file
+	// Set the exposure mode
 	{
-		cam->file = fopen(path, "wb");
-		if(!cam->file)
+		MMAL_PARAMETER_EXPOSUREMODE_T mode = {
+			{MMAL_PARAMETER_EXPOSURE_MODE, sizeof(mode)},
+			_profiles[profile].exposure_mode,
+		};
+
+		status = mmal_port_parameter_set(cam->camera_component->control, &mode.hdr);
+		if(status != MMAL_SUCCESS)
 		{
-			_error = "Failed to open output file.";
-			goto error;
+			_error = "Failed to set exposure mode.";
+			return 1;
 		}
 	}
 
-	// Enable the connection from the camera to the encoder
+	// Set the exposure compensation
 	{
-		status = mmal_connection_enable(cam->encoder_connection);
+		status = mmal_port_parameter_set_int32(cam->camera_component->control, MMAL_PARAMETER_EXPOSURE_COMP, _profiles[profile].exposure_compensation);
 		if(status != MMAL_SUCCESS)
 		{
-			_error = "Failed to enable connection from camera to encoder.";
-			goto error;
+			_error = "Failed to set exposure compensation.";
+			return 1;
 		}
 	}
 
-	// Enable the encoder's output port
+	// Set the DRC mode
 	{
-		cam->encoder_out_port->userdata = (struct MMAL_PORT_USERDATA_T *)cam;		
+		MMAL_PARAMETER_DRC_T drc = {
+			{MMAL_PARAMETER_DYNAMIC_RANGE_COMPRESSION, sizeof(drc)},
+			_profiles[profile].drc,
+		};
 
-		status = mmal_port_enable(cam->encoder_out_port, &cam_callback_encoder_out);
+		status = mmal_port_parameter_set(cam->camera_component->control, &drc.hdr);
 		if(status != MMAL_SUCCESS)
 		{
-			_error = "Failed to enable encoder output port.";
+			_error = "Failed to set DRC mode.";
 			return 1;
 		}
 	}
 
-	// Request a keyframe
+	return 0;
+}
+
+// Segments are named after the prefix: prefix.000.mp4 and up, or .h264 for a
+// raw stream, with its index in .idx
+int cam_start(cam_t cam, const char *prefix)
+{
+	if(cam_recording(cam))
 	{
-		status = mmal_port_parameter_set_boolean(cam->encoder_out_port, MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME, 1);
-		if(status != MMAL_SUCCESS)
-		{
-			_error = "Failed to request a keyframe.";
-			goto error;
-		}
+		_error = "Camera is already recording.";
+		return 1;
 	}
 
-	// Feed the encoder's output port
+	// Open the file
 	{
-		MMAL_BUFFER_HEADER_T *buffer;
-		while(buffer = mmal_queue_get(cam->output_pool->queue))
+		if(writer_start(cam->writer, prefix, VID_MP4 ? ".mp4" : ".h264"))
 		{
-			status = mmal_port_send_buffer(cam->encoder_out_port, buffer);
-			if(status != MMAL_SUCCESS)
-			{
-				_error = "Failed to send buffer to encoder input port.";
-				return 1;
-			}
+			_error = writer_error();
+			return 1;
 		}
-	}
 
-	// Start capturing on the camera video port
-	{
-		status = mmal_port_parameter_set_boolean(cam->camera_video_port, MMAL_PARAMETER_CAPTURE, 1);
-		if(status != MMAL_SUCCESS)
+		if(cam->index && writer_start(cam->index, prefix, ".idx"))
 		{
-			_error = "Failed to start capturing on the camera video port.";
-			goto error;
+			_error = writer_error();
+			writer_stop(cam->writer);
+			return 1;
 		}
-	}
 
-	return 0;
+		cam->skipping = 0;
+		cam->segment_open = 0;
+		cam->output_frame_start = 1;
+		cam->output_pts = 0;
 
-error:
-	if(cam->encoder_out_port->is_enabled)
+		if(VID_MP4)
+		{
+			mp4_discard(cam->mp4);
+			mp4_release(cam->mp4);
+			cam->mux_skipping = 0;
+		}
+	}
+
+	// The running encoder picks this up at its next frame and writes out the
+	// pre-record buffer first
+	if(VID_PRERECORD)
 	{
-		mmal_port_disable(cam->encoder_out_port);
+		atomic_store(&cam->state, CAM_STARTING);
+		return 0;
 	}
 
-	if(cam->file)
+	atomic_store(&cam->state, CAM_RECORDING);
+	if(cam_run_encoder(cam))
 	{
-		fclose(cam->file);
-		cam->file = 0;
+		atomic_store(&cam->state, CAM_IDLE);
+		writer_stop(cam->writer);
+		if(cam->index) writer_stop(cam->index);
+		return 1;
 	}
 
-	return 1;
+	return 0;
 }
 
 int cam_stop(cam_t cam)
 {
-	MMAL_STATUS_T status;
+	int stalled = 0;
 
 	if(!cam_recording(cam))
 	{
@@ -853,47 +1559,54 @@ int cam_stop(cam_t cam)
 		return 1;
 	}
 
-	// Stop capturing on the camera video port
+	// The file ends with the frame before the encoder sees the request. An
+	// encoder that has stalled would never see it, so after a few frames the
+	// recording is closed without it.
+	if(VID_PRERECORD)
 	{
-		status = mmal_port_parameter_set_boolean(cam->camera_video_port, MMAL_PARAMETER_CAPTURE, 0);
-		if(status != MMAL_SUCCESS)
+		uint64_t end = cam_now() + VID_STOP_FRAMES * 1000000ull * VID_FRAMERATE_DEN / VID_FRAMERATE_NUM;
+		int expected = CAM_STOPPING;
+
+		atomic_store(&cam->state, CAM_STOPPING);
+		while(atomic_load(&cam->state) != CAM_IDLE && cam_now() < end)
+			usleep(1000);
+
+		// The callback may finish the stop itself between the check and here
+		if(atomic_compare_exchange_strong(&cam->state, &expected, CAM_IDLE))
 		{
-			_error = "Failed to stop capturing on the camera video port.";
-			return 1;
+			cam_finish(cam);
+			stalled = 1;
 		}
 	}
-
-	// Disable the connection from splitter to encoder
+	else
 	{
-		status = mmal_connection_disable(cam->encoder_connection);
-		if(status != MMAL_SUCCESS)
-		{
-			_error = "Failed to disable connection from splitter to encoder.";
-			return 1;
-		}
+		if(cam_halt_encoder(cam)) return 1;
+		cam_finish(cam);
+		atomic_store(&cam->state, CAM_IDLE);
 	}
 
-	// Disable the encoder's output port
+	// Close the files once the writers have caught up
 	{
-		status = mmal_port_disable(cam->encoder_out_port);
-		if(status != MMAL_SUCCESS)
+		int status = writer_stop(cam->writer);
+
+		if(cam->index) status |= writer_stop(cam->index);
+		if(status)
 		{
-			_error = "Failed to disable encoder output port.";
+			_error = writer_error();
 			return 1;
 		}
 	}
 
-	// Wait for encoder to flush
-	{
-		unsigned int expected = cam->encoder_out_port->buffer_num;
-		while(mmal_queue_length(cam->output_pool->queue) < expected);
-	}
-
-	// Close the file
+	if(stalled)
 	{
-		fclose(cam->file);
-		cam->file = 0;
+		_error = "Timed out waiting for the encoder to stop recording.";
+		return 1;
 	}
 
 	return 0;
-}
\ No newline at end of file
+}
+
+void cam_write_stats(cam_t cam, writer_stats_t *stats)
+{
+	writer_stats(cam->writer, stats);
+}
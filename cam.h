@@ -1,11 +1,23 @@
 #pragma once
 
+#include <stdint.h>
+
+#include "writer.h"
+
+#define CAM_PROFILES 3
+
 typedef struct cam *cam_t;
 
 void cam_deinit(cam_t cam);
 const char *cam_error(void);
 cam_t cam_init(void);
 
+int cam_frame_fd(cam_t cam);
+unsigned int cam_last_frame(cam_t cam, uint64_t *time, int64_t *pts, uint32_t *flags);
+
 int cam_recording(cam_t cam);
-int cam_start(cam_t cam, const char *path);
+int cam_set_priority(cam_t cam, int priority);
+int cam_set_profile(cam_t cam, unsigned int profile);
+int cam_start(cam_t cam, const char *prefix);
 int cam_stop(cam_t cam);
+void cam_write_stats(cam_t cam, writer_stats_t *stats);
@@ -1,20 +1,745 @@
 #include <dirent.h>
+#include <errno.h>
+#include <malloc.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <bcm_host.h>
+#include "blackbox.h"
 #include "cam.h"
+#include "histogram.h"
 #include "input.h"
 #include "osd.h"
+#include "ring.h"
+#include "sbus.h"
 #include "telem.h"
 
+// Set to write a flight-data log next to each recording
+#define LOG_ENABLE 1
+
+// Switch channels come from the input pin, as a single PWM pulse or a PPM sum
+// stream, from the RC channels of the telemetry link (CRSF), or from an SBUS
+// receiver on SBUS_DEVICE
+#define SWITCH_PWM 0
+#define SWITCH_PPM 1
+#define SWITCH_TELEM 2
+#define SWITCH_SBUS 3
+#define SWITCH_SOURCE SWITCH_PWM
+
+#define SBUS_DEVICE "/dev/ttyAMA1"
+
+// 1-based channel of each switch, or 0 if it isn't used. A PWM pulse only
+// carries channel 1.
+#define REC_CHANNEL 1
+#define PAGE_CHANNEL 0
+#define PROFILE_CHANNEL 0
+
+// Switch positions are spread evenly over the channel range, and a channel
+// must cross a boundary by this much to move the switch (microseconds)
+#define SWITCH_MIN 1000
+#define SWITCH_MAX 2000
+#define SWITCH_HYSTERESIS 50
+
+// GPIO character device and line for the input pin, timed by the kernel, or 0
+// to poll the pin through bcm2835 instead
+#define REC_GPIO_CHIP "/dev/gpiochip0"
+#define REC_GPIO_LINE 4
+#define REC_FILTER INPUT_FILTER_MEDIAN
+
+// Sampling period of the pin when it is polled through bcm2835, in
+// microseconds. Every other source wakes the loop by itself.
+#define REC_SAMPLE 100
+
+// Set to tee raw telemetry into a capture file for telem-replay
+#define TEL_CAPTURE 0
+#define TEL_DEVICE "/dev/ttyAMA0"
+#define TEL_PROTOCOL TELEM_PROTOCOL_HUB
+
+// Baud rate, or 0 for the protocol's default
+#define TEL_BAUD 0
+
+// Milliseconds to spend searching for the protocol, baud rate and inversion
+// at start-up, or 0 to use the settings above as they are
+#define TEL_DETECT 3000
+
+// Optional second telemetry port, e.g. a GPS or ESC on a USB adapter, merged
+// into the same values. Where both ports send an ID, the higher priority wins
+// while it keeps sending.
+#define TEL_EXTRA_DEVICE 0
+#define TEL_EXTRA_PROTOCOL TELEM_PROTOCOL_SPORT
+#define TEL_EXTRA_BAUD 0
+#define TEL_EXTRA_PRIORITY 1
+
 #define VID_DIR "/mnt/mmcblk0p1/fpv/"
 
+// Set to lock and prefault all memory and run the time-critical threads under
+// SCHED_FIFO at these priorities. Needs root, or CAP_IPC_LOCK and
+// CAP_SYS_NICE; without them fpv warns and runs as usual.
+#define RT_ENABLE 0
+#define RT_PRIORITY_INPUT 80
+#define RT_PRIORITY_ENCODER 70
+#define RT_PRIORITY_TELEM 60
+
+// Stack of the input and telemetry threads, and heap that malloc faults in
+// and keeps before the threads start (bytes)
+#define RT_STACK (256 * 1024)
+#define RT_HEAP (8 * 1024 * 1024)
+
+// Queue sizes between the threads, in messages
+#define RING_SWITCH 64
+#define RING_TELEM 1024
+#define RING_OSD 256
+
+// Input, telemetry and the OSD each run on their own thread and send messages
+// to the main thread, which controls recording and writes the flight log, or
+// to the OSD thread. The fields a and b depend on the type.
+enum
+{
+	MSG_SWITCH, // a filtered value, b 1 while the raw width is past the midpoint, source_time when it crossed
+	MSG_TELEM, // a value
+	MSG_ALTITUDE,
+	MSG_CELL_MIN,
+	MSG_CONSUMED,
+	MSG_HEADING,
+	MSG_HOME, // a distance, b bearing
+	MSG_PAGE,
+	MSG_RECORDING,
+	MSG_VOLTAGE, // a voltage, b cells
+	MSG_VSPEED,
+};
+
+typedef struct
+{
+	uint64_t time;
+	uint64_t source_time;
+	int32_t a;
+	int32_t b;
+	uint8_t type;
+	uint8_t id;
+} message_t;
+
+// A queue with one producer and one consumer, and the time its messages spent
+// waiting, measured by the consumer
+typedef struct
+{
+	const char *name;
+	ring_t ring;
+	histogram_t latency;
+} stage_t;
+
+enum
+{
+	STAGE_SWITCH,
+	STAGE_TELEM,
+	STAGE_OSD_TELEM,
+	STAGE_OSD_COMMAND,
+	STAGES,
+};
+
+static stage_t stages[STAGES] = {
+	{"Switches"},
+	{"Telemetry log"},
+	{"Telemetry OSD"},
+	{"OSD commands"},
+};
+
+enum
+{
+	SWITCH_RECORD,
+	SWITCH_PAGE,
+	SWITCH_PROFILE,
+	SWITCHES,
+};
+
+static const unsigned int switch_channels[SWITCHES] = {REC_CHANNEL, PAGE_CHANNEL, PROFILE_CHANNEL};
+
+// What the worker threads own
+typedef struct
+{
+	input_t input;
+	sbus_t sbus;
+	telem_t telem;
+	osd_t osd;
+	int timer;
+} context_t;
+
+static blackbox_t blackbox;
+static atomic_int logging;
+static int stop_fd = -1;
+
+// Switch-to-recording latency, and switch flips too brief to start recording,
+// printed on SIGUSR1 along with the input statistics
+static histogram_t rec_latency;
+static uint32_t rec_brief;
+static volatile sig_atomic_t report_requested;
+
+// Time from a switch input event, an edge or a sampling tick, until the input
+// thread runs, written by that thread
+static histogram_t rt_latency;
+
+// Loop wake-ups and CPU time, sampled at each report to give rates since the
+// last one
+typedef struct
+{
+	uint64_t time;
+	uint64_t wakeups;
+	uint64_t faults_major;
+	uint64_t faults_minor;
+	uint64_t process;
+	uint64_t idle;
+	uint64_t total;
+} loop_sample_t;
+
+static uint64_t loop_wakeups;
+static loop_sample_t loop_last;
+
+static uint64_t fpv_now(void)
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000 + ((uint64_t)time.tv_nsec + 500) / 1000;
+}
+
+// CPU time of the whole process in microseconds, and the system's idle and
+// total time in jiffies
+static void loop_sample(loop_sample_t *sample)
+{
+	struct rusage usage;
+	unsigned long long user, nice, system, idle, iowait, irq, softirq, steal;
+	FILE *file;
+
+	sample->time = fpv_now();
+	sample->wakeups = loop_wakeups;
+
+	getrusage(RUSAGE_SELF, &usage);
+	sample->faults_major = usage.ru_majflt;
+	sample->faults_minor = usage.ru_minflt;
+	sample->process = (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+
+	sample->idle = sample->total = 0;
+	file = fopen("/proc/stat", "r");
+	if(!file) return;
+
+	if(fscanf(file, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal) == 8)
+	{
+		sample->idle = idle + iowait;
+		sample->total = user + nice + system + idle + iowait + irq + softirq + steal;
+	}
+	fclose(file);
+}
+
+static void on_report(int signal)
+{
+	(void)signal;
+	report_requested = 1;
+}
+
+// Faults in the pages a thread's stack will use, so it doesn't fault them in
+// while it runs
+static void rt_prefault_stack(void)
+{
+	volatile char stack[RT_STACK / 2];
+	size_t i;
+
+	for(i = 0; i < sizeof(stack); i += 4096)
+		stack[i] = 0;
+}
+
+// Locks what is mapped now and whatever is mapped later, and has malloc keep
+// a faulted-in heap instead of returning memory or mapping new blocks
+static void rt_lock_memory(void)
+{
+	volatile char *heap;
+	size_t i;
+
+	if(mlockall(MCL_CURRENT | MCL_FUTURE))
+	{
+		fprintf(stderr, "WARNING: Failed to lock memory: %s\n", strerror(errno));
+		return;
+	}
+
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+
+	heap = malloc(RT_HEAP);
+	if(heap)
+	{
+		for(i = 0; i < RT_HEAP; i += 4096)
+			heap[i] = 0;
+		free((void *)heap);
+	}
+
+	rt_prefault_stack();
+}
+
+static void rt_thread(const char *name, int priority)
+{
+	struct sched_param param = {.sched_priority = priority};
+	int status;
+
+	if(!RT_ENABLE) return;
+
+	rt_prefault_stack();
+
+	status = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	if(status)
+		fprintf(stderr, "WARNING: Failed to make the %s thread real-time: %s\n", name, strerror(status));
+}
+
+static void stage_send(stage_t *stage, message_t *message)
+{
+	message->time = fpv_now();
+	ring_push(stage->ring, message);
+}
+
+static int stage_receive(stage_t *stage, message_t *message)
+{
+	if(!ring_pop(stage->ring, message)) return 0;
+
+	histogram_add(&stage->latency, fpv_now() - message->time);
+	return 1;
+}
+
+static void print_report(cam_t cam, input_t input)
+{
+	{
+		loop_sample_t sample;
+		uint64_t elapsed, total;
+
+		loop_sample(&sample);
+		elapsed = sample.time - loop_last.time;
+		total = sample.total - loop_last.total;
+
+		if(elapsed)
+		{
+			fprintf(stderr, "Loop: %llu wakeups/s, fpv %llu.%llu%% CPU, system %llu%% idle\n",
+				(unsigned long long)((sample.wakeups - loop_last.wakeups) * 1000000 / elapsed),
+				(unsigned long long)((sample.process - loop_last.process) * 100 / elapsed),
+				(unsigned long long)((sample.process - loop_last.process) * 1000 / elapsed % 10),
+				(unsigned long long)(total ? (sample.idle - loop_last.idle) * 100 / total : 0));
+		}
+
+		fprintf(stderr, "Page faults: %llu major, %llu minor\n",
+			(unsigned long long)(sample.faults_major - loop_last.faults_major),
+			(unsigned long long)(sample.faults_minor - loop_last.faults_minor));
+
+		loop_last = sample;
+	}
+
+	if(input)
+	{
+		input_stats_t stats;
+		int i;
+
+		input_stats(input, &stats);
+		fprintf(stderr, "Input: %u pulses, %u rejected, %u edges lost\n", stats.pulses, stats.rejected, stats.lost);
+
+		for(i = 0; i < INPUT_HISTOGRAM; i++)
+		{
+			if(!stats.widths[i]) continue;
+
+			if(i < INPUT_HISTOGRAM - 1)
+				fprintf(stderr, "  %4u-%4u us: %u\n", i * INPUT_HISTOGRAM_WIDTH, (i + 1) * INPUT_HISTOGRAM_WIDTH - 1, stats.widths[i]);
+			else
+				fprintf(stderr, "  %4u+     us: %u\n", i * INPUT_HISTOGRAM_WIDTH, stats.widths[i]);
+		}
+	}
+
+	histogram_print(&rt_latency, stderr, "Input wake-up latency", "us");
+	histogram_print(&rec_latency, stderr, "Record latency", "us");
+	fprintf(stderr, "Record flips too brief to start: %u\n", rec_brief);
+
+	{
+		writer_stats_t stats;
+
+		cam_write_stats(cam, &stats);
+		fprintf(stderr, "Recording: %llu bytes written in %u segments, buffer peak %zu of %zu KiB\n",
+			(unsigned long long)stats.written, stats.segments, stats.depth_max / 1024, stats.size / 1024);
+		fprintf(stderr, "Recording stalls: %u slow writes, %u failed, %u overruns dropping %llu bytes\n",
+			stats.slow_writes, stats.errors, stats.overruns, (unsigned long long)stats.dropped);
+		histogram_print(&stats.write_time, stderr, "Recording write time", "us");
+		histogram_print(&stats.sync_time, stderr, "Recording fdatasync time", "us");
+	}
+
+	// Figures kept by other threads may be a message behind
+	{
+		int i;
+
+		for(i = 0; i < STAGES; i++)
+		{
+			ring_stats_t stats;
+			char name[40];
+
+			ring_stats(stages[i].ring, &stats);
+			fprintf(stderr, "%s queue: depth %u, max %u, %u sent, %u dropped\n", stages[i].name,
+				ring_depth(stages[i].ring), stats.depth_max, stats.pushed, stats.dropped);
+
+			snprintf(name, sizeof(name), "%s latency", stages[i].name);
+			histogram_print(&stages[i].latency, stderr, name, "us");
+		}
+	}
+}
+
+static void blackbox_telem_changed(void *data, telem_t telem, const telem_mask_t *changed)
+{
+	stage_t *stage = (stage_t *)data;
+	int i;
+
+	if(!atomic_load_explicit(&logging, memory_order_relaxed)) return;
+
+	for(i = 0; i < 8; i++)
+	{
+		uint32_t bits = changed->bits[i];
+		while(bits)
+		{
+			message_t message = {.type = MSG_TELEM};
+
+			message.id = i * 32 + __builtin_ctz(bits);
+			message.a = telem_get_raw(telem, message.id);
+			bits &= bits - 1;
+
+			stage_send(stage, &message);
+		}
+	}
+}
+
+static void blackbox_open_slot(unsigned int slot, telem_t telem)
+{
+	char path[sizeof(VID_DIR) + 10 + 1 + 3];
+	telem_snapshot_t snapshot;
+	uint64_t time;
+	int id;
+
+	sprintf(path, VID_DIR "%06u.log", slot);
+
+	blackbox = blackbox_open(path);
+	if(!blackbox)
+	{
+		fprintf(stderr, "WARNING: Failed to open flight log: %s\n", blackbox_error());
+		return;
+	}
+
+	// Start from the current values so the log stands on its own. Changes are
+	// queued from before the snapshot, so none fall between the two.
+	atomic_store(&logging, 1);
+	telem_snapshot(telem, &snapshot);
+	time = fpv_now();
+
+	for(id = 0; id < 256; id++)
+	{
+		if(snapshot.values[id]) blackbox_telem(blackbox, time, id, snapshot.values[id]);
+	}
+
+	blackbox_record(blackbox, 1);
+}
+
+// Waits for the log's queued blocks to reach the card
+static void blackbox_close_slot(void)
+{
+	if(blackbox_dropped(blackbox))
+		fprintf(stderr, "WARNING: The card fell behind; %u flight log blocks were dropped.\n", blackbox_dropped(blackbox));
+
+	blackbox_close(blackbox);
+	blackbox = 0;
+}
+
+static void osd_send(stage_t *stage, uint8_t type, int32_t a, int32_t b)
+{
+	message_t message = {.type = type, .a = a, .b = b};
+	stage_send(stage, &message);
+}
+
+static void osd_telem_changed(void *data, telem_t telem, const telem_mask_t *changed)
+{
+	stage_t *stage = (stage_t *)data;
+
+	if(telem_mask_test(changed, TELEM_ID_ALT) || telem_mask_test(changed, TELEM_ID_ALT_FRAC))
+		osd_send(stage, MSG_ALTITUDE, telem_get_altitude(telem), 0);
+
+	if(telem_mask_test(changed, TELEM_ID_HEADING) || telem_mask_test(changed, TELEM_ID_HEADING_FRAC))
+		osd_send(stage, MSG_HEADING, telem_get_heading(telem), 0);
+
+	if(telem_mask_test(changed, TELEM_ID_VFAS) || telem_mask_test(changed, TELEM_ID_CELL))
+		osd_send(stage, MSG_VOLTAGE, telem_get_vfas_voltage(telem), telem_get_cells(telem));
+
+	if(telem_mask_test(changed, TELEM_ID_VSPEED))
+		osd_send(stage, MSG_VSPEED, telem_get_vspeed(telem), 0);
+
+	if(telem_mask_test(changed, TELEM_ID_CELL_MIN))
+		osd_send(stage, MSG_CELL_MIN, telem_get_raw(telem, TELEM_ID_CELL_MIN), 0);
+
+	if(telem_mask_test(changed, TELEM_ID_CONSUMED))
+		osd_send(stage, MSG_CONSUMED, telem_get_raw(telem, TELEM_ID_CONSUMED), 0);
+
+	if(telem_get_raw(telem, TELEM_ID_HOME_SET) && (telem_mask_test(changed, TELEM_ID_HOME_SET) ||
+		telem_mask_test(changed, TELEM_ID_HOME_DISTANCE) || telem_mask_test(changed, TELEM_ID_HOME_BEARING)))
+		osd_send(stage, MSG_HOME, telem_get_raw(telem, TELEM_ID_HOME_DISTANCE), telem_get_raw(telem, TELEM_ID_HOME_BEARING));
+}
+
+static void osd_apply(osd_t osd, const message_t *message)
+{
+	switch(message->type)
+	{
+		case MSG_ALTITUDE:
+			osd_set_altitude(osd, message->a);
+			break;
+
+		case MSG_CELL_MIN:
+			osd_set_cell_min(osd, message->a);
+			break;
+
+		case MSG_CONSUMED:
+			osd_set_consumed(osd, message->a);
+			break;
+
+		case MSG_HEADING:
+			osd_set_heading(osd, message->a);
+			break;
+
+		case MSG_HOME:
+			osd_set_home(osd, message->a, message->b);
+			break;
+
+		case MSG_PAGE:
+			osd_set_page(osd, message->a);
+			break;
+
+		case MSG_RECORDING:
+			osd_set_recording(osd, message->a);
+			break;
+
+		case MSG_VOLTAGE:
+			osd_set_voltage(osd, message->a, message->b);
+			break;
+
+		case MSG_VSPEED:
+			osd_set_vspeed(osd, message->a);
+			break;
+	}
+}
+
+static uint16_t switch_value(context_t *context, unsigned int channel)
+{
+#if SWITCH_SOURCE == SWITCH_TELEM
+	return telem_get_channel(context->telem, channel - 1);
+#elif SWITCH_SOURCE == SWITCH_SBUS
+	// Failsafe values come from the receiver, not the pilot
+	if(sbus_failsafe(context->sbus)) return 0;
+	return sbus_get_channel(context->sbus, channel - 1);
+#else
+	return input_get_channel(context->input, channel - 1);
+#endif
+}
+
+// Unfiltered value of a switch channel and when it arrived
+static uint16_t switch_raw(context_t *context, unsigned int channel, uint64_t *time)
+{
+#if SWITCH_SOURCE == SWITCH_PWM || SWITCH_SOURCE == SWITCH_PPM
+	return input_get_raw(context->input, channel - 1, time);
+#else
+	*time = fpv_now();
+	return switch_value(context, channel);
+#endif
+}
+
+// Sends each switch whose value, or side of the midpoint, has changed
+static void switch_publish(context_t *context, message_t *last)
+{
+	int i;
+
+	for(i = 0; i < SWITCHES; i++)
+	{
+		message_t message = {.type = MSG_SWITCH, .id = i};
+		uint64_t time;
+
+		if(!switch_channels[i]) continue;
+
+		message.a = switch_value(context, switch_channels[i]);
+		message.b = switch_raw(context, switch_channels[i], &time) > (SWITCH_MIN + SWITCH_MAX) / 2;
+		if(message.a == last[i].a && message.b == last[i].b) continue;
+
+		message.source_time = message.b != last[i].b ? time : last[i].source_time;
+		last[i] = message;
+
+		stage_send(&stages[STAGE_SWITCH], &message);
+	}
+}
+
+static void *input_thread(void *data)
+{
+	context_t *context = (context_t *)data;
+	message_t last[SWITCHES] = {{0}};
+	uint64_t edge_time = 0;
+	struct pollfd fds[2] = {
+		{.fd = stop_fd, .events = POLLIN},
+		{.events = POLLIN},
+	};
+
+	rt_thread("input", RT_PRIORITY_INPUT);
+
+	if(context->timer >= 0) fds[1].fd = context->timer;
+	else if(context->input) fds[1].fd = input_fd(context->input);
+	else fds[1].fd = sbus_fd(context->sbus);
+
+	while(1)
+	{
+		if(poll(fds, 2, -1) < 0) continue;
+		if(fds[0].revents) break;
+
+		// Wake-up latency is how long ago the tick was due, or how long ago the
+		// kernel stamped the newest edge
+		if(context->timer >= 0)
+		{
+			uint64_t expirations;
+			struct itimerspec remaining;
+
+			if(read(context->timer, &expirations, sizeof(expirations)) == sizeof(expirations) && !timerfd_gettime(context->timer, &remaining))
+				histogram_add(&rt_latency, expirations * REC_SAMPLE - remaining.it_value.tv_nsec / 1000);
+		}
+
+		if(context->sbus) sbus_update(context->sbus);
+		else input_update(context->input);
+
+		if(context->input && context->timer < 0 && input_edge_time(context->input) != edge_time)
+		{
+			edge_time = input_edge_time(context->input);
+			histogram_add(&rt_latency, fpv_now() - edge_time);
+		}
+
+		switch_publish(context, last);
+	}
+
+	return 0;
+}
+
+static void *telem_thread(void *data)
+{
+	context_t *context = (context_t *)data;
+	message_t last[SWITCHES] = {{0}};
+	struct pollfd fds[1 + TELEM_PORTS];
+	int ports[TELEM_PORTS];
+	unsigned int count, i;
+
+	rt_thread("telemetry", RT_PRIORITY_TELEM);
+
+	fds[0].fd = stop_fd;
+	fds[0].events = POLLIN;
+
+	count = telem_fds(context->telem, ports, TELEM_PORTS);
+	for(i = 0; i < count; i++)
+	{
+		fds[1 + i].fd = ports[i];
+		fds[1 + i].events = POLLIN;
+	}
+
+	while(1)
+	{
+		if(poll(fds, 1 + count, -1) < 0) continue;
+		if(fds[0].revents) break;
+
+		telem_update(context->telem);
+
+		// A hung up port polls ready forever; drop it rather than spin at
+		// real-time priority
+		for(i = 0; i < count; i++)
+		{
+			if(fds[1 + i].fd >= 0 && (fds[1 + i].revents & (POLLHUP | POLLERR | POLLNVAL)))
+			{
+				fprintf(stderr, "WARNING: Telemetry port hung up; it is no longer read.\n");
+				telem_hangup(context->telem, fds[1 + i].fd);
+				fds[1 + i].fd = -1;
+			}
+		}
+
+		// CRSF carries the switches along with the telemetry
+		if(SWITCH_SOURCE == SWITCH_TELEM) switch_publish(context, last);
+	}
+
+	return 0;
+}
+
+// eglSwapBuffers blocks until the display takes the frame, so rendering has a
+// thread to itself
+static void *osd_thread(void *data)
+{
+	context_t *context = (context_t *)data;
+	struct pollfd fds[3] = {
+		{.fd = stop_fd, .events = POLLIN},
+		{.fd = ring_fd(stages[STAGE_OSD_TELEM].ring), .events = POLLIN},
+		{.fd = ring_fd(stages[STAGE_OSD_COMMAND].ring), .events = POLLIN},
+	};
+	message_t message;
+	int i, dirty;
+
+	if(osd_attach(context->osd))
+	{
+		fprintf(stderr, "WARNING: %s The OSD is disabled.\n", osd_error());
+		return 0;
+	}
+
+	while(1)
+	{
+		if(poll(fds, 3, -1) < 0) continue;
+		if(fds[0].revents) break;
+
+		dirty = 0;
+		for(i = STAGE_OSD_TELEM; i <= STAGE_OSD_COMMAND; i++)
+		{
+			ring_acknowledge(stages[i].ring);
+			while(stage_receive(&stages[i], &message))
+			{
+				osd_apply(context->osd, &message);
+				dirty = 1;
+			}
+		}
+
+		// Drawn once per batch, however many values changed
+		if(dirty) osd_update(context->osd);
+	}
+
+	osd_detach(context->osd);
+	return 0;
+}
+
+// New position of a switch, or -1 while it has never seen a signal
+static int switch_position(int position, uint16_t value, int positions)
+{
+	int range = SWITCH_MAX - SWITCH_MIN;
+
+	// No signal holds the switch where it is
+	if(value <= 800) return position;
+
+	if(position >= 0)
+	{
+		int low = SWITCH_MIN + position * range / positions - SWITCH_HYSTERESIS;
+		int high = SWITCH_MIN + (position + 1) * range / positions + SWITCH_HYSTERESIS;
+
+		if(value >= low && value < high) return position;
+	}
+
+	position = ((int)value - SWITCH_MIN) * positions / range;
+	if(position < 0) position = 0;
+	if(position >= positions) position = positions - 1;
+
+	return position;
+}
+
 static int cam_start_slot(cam_t cam, unsigned int slot)
 {
-	char path[sizeof(VID_DIR) + 10 + 1 + 4];
-	sprintf(path, VID_DIR "%06u.h264", slot);
+	char path[sizeof(VID_DIR) + 10];
+	sprintf(path, VID_DIR "%06u", slot);
 
 	return cam_start(cam, path);
 }
@@ -30,7 +755,7 @@ static unsigned int find_free_slot()
 	{
 		while(entry = readdir(dir))
 		{
-			if(sscanf(entry->d_name, "%u.h264", &entry_slot) && entry_slot > last_slot)
+			if(sscanf(entry->d_name, "%u", &entry_slot) && entry_slot > last_slot)
 			{
 				last_slot = entry_slot;
 			}
@@ -44,11 +769,31 @@ int main(int argc, char **argv)
 {
 	cam_t cam = 0;
 	input_t input = 0;
+	sbus_t sbus = 0;
 	osd_t osd = 0;
 	telem_t telem = 0;
 
 	const char *error = 0;
-	unsigned int next_slot;
+	unsigned int last_frame = 0, next_slot;
+	uint16_t last_value = 0;
+	int rec = -1, page = 0, profile = 0;
+	uint64_t rec_request = 0;
+
+	context_t context;
+	message_t switches[SWITCHES] = {{0}}, message;
+	pthread_t threads[3];
+	pthread_attr_t rt_attr;
+	unsigned int thread_count = 0, i;
+	sigset_t signals;
+	int timer = -1;
+
+	// The main thread sleeps in poll() on the switch and telemetry queues, and
+	// on the frame event while a log is open
+	struct pollfd fds[3] = {
+		{.fd = -1, .events = POLLIN},
+		{.fd = -1, .events = POLLIN},
+		{.fd = -1, .events = POLLIN},
+	};
 
 	bcm_host_init();
 
@@ -59,11 +804,26 @@ int main(int argc, char **argv)
 		goto cleanup;
 	}
 
-	input = input_init(7, 1);
-	if(!input)
+	if(SWITCH_SOURCE == SWITCH_PWM || SWITCH_SOURCE == SWITCH_PPM)
 	{
-		error = "Failed to initialize GPIO.";
-		goto cleanup;
+		input = REC_GPIO_CHIP ? input_open(REC_GPIO_CHIP, REC_GPIO_LINE) : input_init(7, 1);
+		if(!input)
+		{
+			error = input_error();
+			goto cleanup;
+		}
+		input_filter(input, REC_FILTER, 7, 1);
+		input_mode(input, SWITCH_SOURCE == SWITCH_PPM ? INPUT_MODE_PPM : INPUT_MODE_PWM);
+	}
+
+	if(SWITCH_SOURCE == SWITCH_SBUS)
+	{
+		sbus = sbus_open(SBUS_DEVICE);
+		if(!sbus)
+		{
+			error = sbus_error();
+			goto cleanup;
+		}
 	}
 
 	osd = osd_init();
@@ -73,50 +833,305 @@ int main(int argc, char **argv)
 		goto cleanup;
 	}
 
-	telem = telem_open("/dev/ttyAMA0");
+	stop_fd = eventfd(0, EFD_CLOEXEC);
+	if(stop_fd < 0)
+	{
+		error = "Failed to create the stop event.";
+		goto cleanup;
+	}
+
+	stages[STAGE_SWITCH].ring = ring_init(RING_SWITCH, sizeof(message_t));
+	stages[STAGE_TELEM].ring = ring_init(RING_TELEM, sizeof(message_t));
+	stages[STAGE_OSD_TELEM].ring = ring_init(RING_OSD, sizeof(message_t));
+	stages[STAGE_OSD_COMMAND].ring = ring_init(RING_OSD, sizeof(message_t));
+	for(i = 0; i < STAGES; i++)
+	{
+		if(!stages[i].ring)
+		{
+			error = ring_error();
+			goto cleanup;
+		}
+	}
+
+	telem = telem_open(TEL_DEVICE);
 	if(!telem)
 	{
 		error = telem_error();
 		goto cleanup;
 	}
+	if(telem_protocol(telem, TEL_PROTOCOL) || (TEL_BAUD && telem_baud(telem, TEL_BAUD)))
+	{
+		error = telem_error();
+		goto cleanup;
+	}
+
+	if(TEL_EXTRA_DEVICE)
+	{
+		int port = telem_add_port(telem, TEL_EXTRA_DEVICE, TEL_EXTRA_PROTOCOL, TEL_EXTRA_BAUD);
+		if(port < 0)
+		{
+			error = telem_error();
+			goto cleanup;
+		}
+
+		telem_port_priority(telem, port, TEL_EXTRA_PRIORITY);
+	}
+
+	if(TEL_DETECT && telem_detect(telem, TEL_DETECT))
+		fprintf(stderr, "WARNING: %s Using the configured settings.\n", telem_error());
+
+	{
+		telem_mask_t ids = {{0}};
+		telem_mask_set(&ids, TELEM_ID_ALT);
+		telem_mask_set(&ids, TELEM_ID_ALT_FRAC);
+		telem_mask_set(&ids, TELEM_ID_CELL);
+		telem_mask_set(&ids, TELEM_ID_HEADING);
+		telem_mask_set(&ids, TELEM_ID_HEADING_FRAC);
+		telem_mask_set(&ids, TELEM_ID_VFAS);
+		telem_mask_set(&ids, TELEM_ID_VSPEED);
+		telem_mask_set(&ids, TELEM_ID_CELL_MIN);
+		telem_mask_set(&ids, TELEM_ID_CONSUMED);
+		telem_mask_set(&ids, TELEM_ID_HOME_SET);
+		telem_mask_set(&ids, TELEM_ID_HOME_DISTANCE);
+		telem_mask_set(&ids, TELEM_ID_HOME_BEARING);
+
+		if(telem_subscribe(telem, &ids, osd_telem_changed, &stages[STAGE_OSD_TELEM]))
+		{
+			error = telem_error();
+			goto cleanup;
+		}
+
+		memset(&ids, 0xff, sizeof(ids));
+		if(LOG_ENABLE && telem_subscribe(telem, &ids, blackbox_telem_changed, &stages[STAGE_TELEM]))
+		{
+			error = telem_error();
+			goto cleanup;
+		}
+	}
 
 	next_slot = find_free_slot();
+	signal(SIGUSR1, on_report);
+
+#if TEL_CAPTURE
+	{
+		char path[sizeof(VID_DIR) + 10 + 1 + 3];
+		sprintf(path, VID_DIR "%06u.tlm", next_slot);
+
+		if(telem_capture(telem, path))
+			fprintf(stderr, "WARNING: Failed to start telemetry capture: %s\n", telem_error());
+	}
+#endif
+
+	if(input && input_fd(input) < 0)
+	{
+		struct itimerspec period = {
+			.it_interval = {0, REC_SAMPLE * 1000},
+			.it_value = {0, REC_SAMPLE * 1000},
+		};
+
+		timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+		if(timer < 0 || timerfd_settime(timer, 0, &period, 0))
+		{
+			error = "Failed to create the input sampling timer.";
+			goto cleanup;
+		}
+	}
+
+	context.input = input;
+	context.sbus = sbus;
+	context.telem = telem;
+	context.osd = osd;
+	context.timer = timer;
+
+	// Locked before the threads start, so their stacks are locked as they are
+	// mapped. Every thread gets a small stack to keep that cheap; the OSD
+	// thread is not real-time but its stack is locked all the same.
+	pthread_attr_init(&rt_attr);
+	if(RT_ENABLE)
+	{
+		rt_lock_memory();
+		pthread_attr_setstacksize(&rt_attr, RT_STACK);
+
+		if(cam_set_priority(cam, RT_PRIORITY_ENCODER))
+			fprintf(stderr, "WARNING: %s\n", cam_error());
+	}
+
+	// Only the main thread takes the report signal, so it interrupts poll()
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &signals, 0);
+
+	osd_detach(osd);
+	if(!pthread_create(&threads[thread_count], &rt_attr, osd_thread, &context)) thread_count++;
+	if(!pthread_create(&threads[thread_count], &rt_attr, telem_thread, &context)) thread_count++;
+	if((input || sbus) && !pthread_create(&threads[thread_count], &rt_attr, input_thread, &context)) thread_count++;
+
+	pthread_sigmask(SIG_UNBLOCK, &signals, 0);
+	pthread_attr_destroy(&rt_attr);
+
+	if(thread_count < ((input || sbus) ? 3 : 2))
+	{
+		error = "Failed to start threads.";
+		goto cleanup;
+	}
+
+	fds[0].fd = ring_fd(stages[STAGE_SWITCH].ring);
+	fds[1].fd = ring_fd(stages[STAGE_TELEM].ring);
+
+	loop_sample(&loop_last);
 	while(1)
 	{
-		input_update(input);
-		uint16_t value = input_get(input);
-		if(value > 1500)
+		// Frames only matter while they are logged; poll() skips a negative fd
+		fds[2].fd = blackbox ? cam_frame_fd(cam) : -1;
+
+		if(poll(fds, 3, -1) < 0)
+		{
+			if(errno != EINTR)
+			{
+				error = "Failed to wait for events.";
+				goto cleanup;
+			}
+
+			for(i = 0; i < 3; i++)
+				fds[i].revents = 0;
+		}
+		loop_wakeups++;
+
+		if(fds[2].revents)
+		{
+			eventfd_t frames;
+			eventfd_read(cam_frame_fd(cam), &frames);
+		}
+
+		ring_acknowledge(stages[STAGE_SWITCH].ring);
+		while(stage_receive(&stages[STAGE_SWITCH], &message))
+		{
+			// Latency runs from the first unfiltered pulse asking to record
+			if(message.id == SWITCH_RECORD && !cam_recording(cam))
+			{
+				if(message.b && !rec_request)
+				{
+					rec_request = message.source_time;
+				}
+				else if(!message.b && rec_request)
+				{
+					rec_brief++;
+					rec_request = 0;
+				}
+			}
+
+			switches[message.id] = message;
+		}
+
+		ring_acknowledge(stages[STAGE_TELEM].ring);
+		while(stage_receive(&stages[STAGE_TELEM], &message))
+		{
+			if(blackbox) blackbox_telem(blackbox, message.time, message.id, message.a);
+		}
+
+		uint16_t value = switches[SWITCH_RECORD].a;
+
+		rec = switch_position(rec, value, 2);
+		if(rec == 1)
 		{
 			if(!cam_recording(cam))
 			{
-				cam_start_slot(cam, next_slot++);
-				osd_set_recording(osd, 1);
+				if(!cam_start_slot(cam, next_slot) && rec_request)
+					histogram_add(&rec_latency, fpv_now() - rec_request);
+				rec_request = 0;
+
+				if(LOG_ENABLE) blackbox_open_slot(next_slot, telem);
+				next_slot++;
+
+				osd_send(&stages[STAGE_OSD_COMMAND], MSG_RECORDING, 1, 0);
 			}
 		}
-		else if(value > 800)
+		else if(rec == 0)
 		{
 			if(cam_recording(cam))
 			{
-				cam_stop(cam);
-				osd_set_recording(osd, 0);
+				if(cam_stop(cam))
+					fprintf(stderr, "WARNING: %s\n", cam_error());
+				if(blackbox)
+				{
+					atomic_store_explicit(&logging, 0, memory_order_relaxed);
+					blackbox_record(blackbox, 0);
+					blackbox_close_slot();
+				}
+
+				osd_send(&stages[STAGE_OSD_COMMAND], MSG_RECORDING, 0, 0);
+			}
+		}
+
+		if(PAGE_CHANNEL)
+		{
+			int position = switch_position(page, switches[SWITCH_PAGE].a, OSD_PAGES);
+			if(position != page)
+			{
+				page = position;
+				osd_send(&stages[STAGE_OSD_COMMAND], MSG_PAGE, page, 0);
+			}
+		}
+
+		if(PROFILE_CHANNEL)
+		{
+			int position = switch_position(profile, switches[SWITCH_PROFILE].a, CAM_PROFILES);
+			if(position != profile)
+			{
+				profile = position;
+				if(cam_set_profile(cam, profile))
+					fprintf(stderr, "WARNING: %s\n", cam_error());
+			}
+		}
+
+		if(blackbox)
+		{
+			uint64_t time;
+			int64_t pts;
+			uint32_t flags;
+			unsigned int frame = cam_last_frame(cam, &time, &pts, &flags);
+
+			if(frame != last_frame)
+			{
+				blackbox_frame(blackbox, time, pts, flags);
+				last_frame = frame;
+			}
+
+			if(value != last_value)
+			{
+				blackbox_input(blackbox, switches[SWITCH_RECORD].time, value);
+				last_value = value;
 			}
 		}
 
-		int result = telem_update(telem);
-		if(result > 0)
+		if(report_requested)
 		{
-			osd_set_altitude(osd, telem_get_altitude(telem));
-			osd_set_heading(osd, telem_get_heading(telem));
-			osd_set_voltage(osd, telem_get_vfas_voltage(telem), telem_get_cells(telem));
-			osd_update(osd);
+			report_requested = 0;
+			print_report(cam, input);
 		}
 	}
 	
 cleanup:
+	if(stop_fd >= 0) eventfd_write(stop_fd, 1);
+	for(i = 0; i < thread_count; i++)
+		pthread_join(threads[i], 0);
+
+	if(timer >= 0) close(timer);
+	if(blackbox) blackbox_close_slot();
 	if(telem) telem_close(telem);
-	if(osd) osd_deinit(osd);
+	if(osd)
+	{
+		osd_attach(osd);
+		osd_deinit(osd);
+	}
+	if(sbus) sbus_close(sbus);
+	if(input) input_deinit(input);
 	if(cam) cam_deinit(cam);
 
+	for(i = 0; i < STAGES; i++)
+		ring_deinit(stages[i].ring);
+	if(stop_fd >= 0) close(stop_fd);
+
 	if(error)
 	{
 		fprintf(stderr, "Fatal error: %s\n", error);
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+
+#define FRAME_INDEX_MAGIC 0x49565046
+#define FRAME_INDEX_VERSION 1
+
+// Entry flags
+#define FRAME_INDEX_KEYFRAME 1
+
+// Each raw H.264 segment, prefix.000.h264, has an index of its frames in
+// prefix.000.idx: this header, then one entry per frame in file order. A frame
+// that was only partly written, after the writer overflowed, has no entry.
+typedef struct
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t entry_size;
+} frame_index_header_t;
+
+typedef struct
+{
+	uint64_t offset; // from the start of the segment file
+	int64_t pts;
+	uint32_t size;
+	uint32_t flags;
+} frame_index_entry_t;
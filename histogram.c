@@ -0,0 +1,72 @@
+#include "histogram.h"
+
+#include <string.h>
+
+static unsigned int histogram_bucket(uint64_t value)
+{
+	return value ? 64 - __builtin_clzll(value) : 0;
+}
+
+// Largest value that falls in the bucket
+static uint64_t histogram_limit(unsigned int bucket)
+{
+	if(bucket >= 64) return UINT64_MAX;
+	return (1ull << bucket) - 1;
+}
+
+void histogram_add(histogram_t *histogram, uint64_t value)
+{
+	if(!histogram->count || value < histogram->min) histogram->min = value;
+	if(value > histogram->max) histogram->max = value;
+
+	histogram->count++;
+	histogram->sum += value;
+	histogram->buckets[histogram_bucket(value)]++;
+}
+
+// An upper bound: the top of the bucket holding the percentile, capped at the
+// largest value seen
+uint64_t histogram_percentile(const histogram_t *histogram, unsigned int percent)
+{
+	uint64_t target = (histogram->count * percent + 99) / 100, seen = 0;
+	unsigned int i;
+
+	for(i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		seen += histogram->buckets[i];
+		if(seen && seen >= target)
+			return histogram_limit(i) < histogram->max ? histogram_limit(i) : histogram->max;
+	}
+
+	return histogram->max;
+}
+
+void histogram_print(const histogram_t *histogram, FILE *file, const char *name, const char *unit)
+{
+	unsigned int i;
+
+	if(!histogram->count)
+	{
+		fprintf(file, "%s: none\n", name);
+		return;
+	}
+
+	fprintf(file, "%s: %llu, min %llu, mean %llu, p50 %llu, p99 %llu, max %llu %s\n", name,
+		(unsigned long long)histogram->count,
+		(unsigned long long)histogram->min,
+		(unsigned long long)(histogram->sum / histogram->count),
+		(unsigned long long)histogram_percentile(histogram, 50),
+		(unsigned long long)histogram_percentile(histogram, 99),
+		(unsigned long long)histogram->max, unit);
+
+	for(i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		if(histogram->buckets[i])
+			fprintf(file, "  <= %llu: %u\n", (unsigned long long)histogram_limit(i), histogram->buckets[i]);
+	}
+}
+
+void histogram_reset(histogram_t *histogram)
+{
+	memset(histogram, 0, sizeof(*histogram));
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Bucket n counts values of bit length n: 0, 1, 2-3, 4-7, ...
+#define HISTOGRAM_BUCKETS 65
+
+typedef struct
+{
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint32_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+void histogram_add(histogram_t *histogram, uint64_t value);
+uint64_t histogram_percentile(const histogram_t *histogram, unsigned int percent);
+void histogram_print(const histogram_t *histogram, FILE *file, const char *name, const char *unit);
+void histogram_reset(histogram_t *histogram);
@@ -1,98 +1,318 @@
 #include "input.h"
+#include "input_backend.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/gpio.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <time.h>
+#include <unistd.h>
 
-#include <bcm2835.h>
-
-#define INPUT_PIN 4
-
-struct input
-{
-	uint64_t change_time;
-	uint16_t value;
-	uint8_t new_weight;
-	uint8_t old_weight;
-	uint8_t state;
-};
+// Edges the kernel queues while we sleep, and edges taken per read
+#define INPUT_EVENT_BUFFER 64
+#define INPUT_EVENT_BATCH 16
 
 static const char *_error;
 
-static uint64_t input_now(void)
+uint64_t input_now(void)
 {
 	struct timespec time;
 	clock_gettime(CLOCK_MONOTONIC, &time);
 	return (uint64_t)time.tv_sec * 1000000 + ((uint64_t)time.tv_nsec + 500) / 1000;
 }
 
+void input_set_error(const char *error)
+{
+	_error = error;
+}
+
+const char *input_error(void)
+{
+	return _error;
+}
+
+input_t input_alloc(void)
+{
+	input_t input = malloc(sizeof(struct input));
+	if(!input)
+	{
+		_error = "Failed to allocate input object.";
+		return 0;
+	}
+
+	memset(input, 0, sizeof(struct input));
+	input->channel = INPUT_CHANNELS;
+	input->fd = -1;
+
+	return input;
+}
+
 void input_deinit(input_t input)
 {
 	if(input)
 	{
+		if(input->fd >= 0) close(input->fd);
 		free(input);
 	}
 }
 
+int input_fd(input_t input)
+{
+	return input->fd;
+}
+
+void input_filter(input_t input, input_filter_t filter, uint8_t old_weight, uint8_t new_weight)
+{
+	input->filter = filter;
+	input->old_weight = old_weight;
+	input->new_weight = new_weight;
+}
+
 uint16_t input_get(input_t input)
 {
-	return input->value;
+	return input->values[0];
 }
 
-input_t input_init(uint8_t old_weight, uint8_t new_weight)
+uint16_t input_get_channel(input_t input, unsigned int channel)
 {
-	input_t input = 0;
-	int result;
+	if(channel >= INPUT_CHANNELS) return 0;
+	return input->values[channel];
+}
 
-	result = bcm2835_init();
-	if(!result)
+uint16_t input_get_raw(input_t input, unsigned int channel, uint64_t *time)
+{
+	if(channel >= INPUT_CHANNELS) return 0;
+	if(time) *time = input->raw_time[channel];
+	return input->raw[channel];
+}
+
+uint64_t input_edge_time(input_t input)
+{
+	return input->edge_time;
+}
+
+void input_stats(input_t input, input_stats_t *stats)
+{
+	*stats = input->stats;
+}
+
+void input_mode(input_t input, input_mode_t mode)
+{
+	input->mode = mode;
+	input->rising = 0;
+	input->channel = INPUT_CHANNELS;
+}
+
+static uint16_t input_median(const uint16_t *history, uint8_t length)
+{
+	uint16_t sorted[INPUT_MEDIAN];
+	uint8_t i, j;
+
+	for(i = 0; i < length; i++)
 	{
-		_error = "Failed to initialize BCM2835 library.";
-		goto fail;
+		for(j = i; j && sorted[j - 1] > history[i]; j--)
+			sorted[j] = sorted[j - 1];
+		sorted[j] = history[i];
 	}
 
-	input = malloc(sizeof(struct input));
-	if(!input)
+	return sorted[length / 2];
+}
+
+// Every measured width is counted; only those in range reach the filter
+static int input_measure(input_t input, uint64_t width)
+{
+	uint64_t bucket = width / INPUT_HISTOGRAM_WIDTH;
+
+	input->stats.widths[bucket < INPUT_HISTOGRAM ? bucket : INPUT_HISTOGRAM - 1]++;
+
+	if(width <= INPUT_PULSE_MIN || width >= INPUT_PULSE_MAX)
 	{
-		_error = "Failed to allocate input object.";
-		goto fail;
+		input->stats.rejected++;
+		return 0;
 	}
-	memset(input, 0, sizeof(struct input));
 
-	bcm2835_gpio_fsel(INPUT_PIN, BCM2835_GPIO_FSEL_INPT);
-	input->state = bcm2835_gpio_lev(INPUT_PIN);
+	input->stats.pulses++;
+	return 1;
+}
 
-	input->change_time = input_now();
-	input->new_weight = new_weight;
-	input->old_weight = old_weight;
+static void input_pulse(input_t input, uint8_t channel, uint64_t width, uint64_t time)
+{
+	uint16_t *value = &input->values[channel];
 
-	return input;
+	input->raw[channel] = width;
+	input->raw_time[channel] = time;
 
-fail:	
-	input_deinit(input);
-	return 0;
+	input->history[channel][input->history_next[channel]] = width;
+	input->history_next[channel] = (input->history_next[channel] + 1) % INPUT_MEDIAN;
+	if(input->history_length[channel] < INPUT_MEDIAN) input->history_length[channel]++;
+
+	switch(input->filter)
+	{
+		case INPUT_FILTER_IIR:
+		{
+			uint32_t num = input->old_weight * (uint32_t)*value + input->new_weight * (uint32_t)width;
+			uint16_t denom = (uint16_t)input->old_weight + (uint16_t)input->new_weight;
+			*value = num / denom;
+			break;
+		}
+
+		case INPUT_FILTER_MEDIAN:
+			*value = input_median(input->history[channel], input->history_length[channel]);
+			break;
+
+		default:
+			*value = width;
+			break;
+	}
 }
 
-void input_update(input_t input)
+// PPM channels are the spacing of rising edges, which holds for either
+// polarity of the stream; a long gap marks the start of a frame
+static void input_ppm_edge(input_t input, uint64_t time)
+{
+	uint64_t width = time - input->rise_time;
+	uint8_t i;
+
+	if(width >= INPUT_PPM_SYNC)
+	{
+		// Channels missing from this frame are gone, not stale
+		if(input->channel < INPUT_CHANNELS)
+		{
+			for(i = input->channel; i < input->channels; i++)
+				input->values[i] = 0;
+			input->channels = input->channel;
+		}
+
+		input->channel = 0;
+	}
+	else if(input->channel < INPUT_CHANNELS)
+	{
+		if(input_measure(input, width))
+			input_pulse(input, input->channel++, width, time);
+		else
+			input->channel = INPUT_CHANNELS;
+	}
+}
+
+void input_edge(input_t input, uint8_t level, uint64_t time)
 {
-	uint8_t new_state = bcm2835_gpio_lev(INPUT_PIN);
-	if(new_state != input->state)
+	input->edge_time = time;
+
+	if(level)
+	{
+		if(input->mode == INPUT_MODE_PPM && input->rising)
+			input_ppm_edge(input, time);
+
+		input->rise_time = time;
+		input->rising = 1;
+	}
+	else if(input->mode == INPUT_MODE_PWM && input->rising)
 	{
-		uint64_t old_time = input->change_time;
-		input->change_time = input_now();
+		uint64_t width = time - input->rise_time;
+
+		if(input_measure(input, width))
+			input_pulse(input, 0, width, time);
+
+		input->rising = 0;
+	}
+}
+
+// After a missed edge, nothing is measured until the decoder is back in step
+void input_lost(input_t input)
+{
+	input->stats.lost++;
+	input->rising = 0;
+	input->channel = INPUT_CHANNELS;
+}
+
+void input_update(input_t input)
+{
+	input->update(input);
+}
 
-		if(!new_state)
+int input_wait(input_t input, int timeout)
+{
+	struct pollfd fd = {
+		.fd = input->fd,
+		.events = POLLIN,
+	};
+
+	// The polled pin has nothing to wait on
+	if(input->fd < 0) return 1;
+
+	return poll(&fd, 1, timeout) > 0;
+}
+
+// Pulse widths come from the kernel's edge timestamps, so they don't depend on
+// how soon the events are read. An edge lost to a full buffer shows up as a
+// gap in the sequence numbers.
+static void input_gpio_update(input_t input)
+{
+	struct gpio_v2_line_event events[INPUT_EVENT_BATCH];
+	ssize_t count;
+	size_t i;
+
+	while((count = read(input->fd, events, sizeof(events))) > 0)
+	{
+		for(i = 0; i < count / sizeof(events[0]); i++)
 		{
-			uint64_t delta_time = input->change_time - old_time;
-			if(delta_time > 800 && delta_time < 2200)
-			{
-				uint32_t num = input->old_weight * (uint32_t)input->value + input->new_weight * (uint32_t)delta_time;
-				uint16_t denom = (uint16_t)input->old_weight + (uint16_t)input->new_weight;
-				input->value = num / denom;
-			}
+			const struct gpio_v2_line_event *event = &events[i];
+
+			if(event->line_seqno != input->seqno + 1)
+				input_lost(input);
+			input->seqno = event->line_seqno;
+
+			input_edge(input, event->id == GPIO_V2_LINE_EVENT_RISING_EDGE, (event->timestamp_ns + 500) / 1000);
 		}
 
-		input->state = new_state;
+		if((size_t)count < sizeof(events)) break;
 	}
 }
+
+input_t input_open(const char *chip, unsigned int line)
+{
+	struct gpio_v2_line_request request;
+	input_t input = 0;
+	int fd = -1;
+
+	input = input_alloc();
+	if(!input) goto fail;
+
+	fd = open(chip, O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+	{
+		_error = strerror(errno);
+		goto fail;
+	}
+
+	memset(&request, 0, sizeof(request));
+	request.offsets[0] = line;
+	request.num_lines = 1;
+	request.event_buffer_size = INPUT_EVENT_BUFFER;
+	request.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+	snprintf(request.consumer, sizeof(request.consumer), "fpv");
+
+	if(ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &request) < 0)
+	{
+		_error = strerror(errno);
+		goto fail;
+	}
+
+	close(fd);
+	fd = -1;
+
+	input->fd = request.fd;
+	fcntl(input->fd, F_SETFL, fcntl(input->fd, F_GETFL) | O_NONBLOCK);
+	input->update = input_gpio_update;
+
+	return input;
+
+fail:
+	if(fd >= 0) close(fd);
+	input_deinit(input);
+	return 0;
+}
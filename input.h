@@ -2,10 +2,47 @@
 
 #include <stdint.h>
 
+typedef enum
+{
+	INPUT_FILTER_NONE,
+	INPUT_FILTER_IIR,
+	INPUT_FILTER_MEDIAN,
+} input_filter_t;
+
+typedef enum
+{
+	INPUT_MODE_PWM,
+	INPUT_MODE_PPM,
+} input_mode_t;
+
+#define INPUT_CHANNELS 12
+
+// Measured widths in 100 us buckets; the last also counts anything longer
+#define INPUT_HISTOGRAM 32
+#define INPUT_HISTOGRAM_WIDTH 100
+
+typedef struct
+{
+	uint32_t pulses;
+	uint32_t rejected;
+	uint32_t lost;
+	uint32_t widths[INPUT_HISTOGRAM];
+} input_stats_t;
+
 typedef struct input *input_t;
 
 input_t input_init(uint8_t old_weight, uint8_t new_weight);
+input_t input_open(const char *chip, unsigned int line);
 void input_deinit(input_t input);
+const char *input_error(void);
 
+int input_fd(input_t input);
+void input_filter(input_t input, input_filter_t filter, uint8_t old_weight, uint8_t new_weight);
 uint16_t input_get(input_t input);
+uint16_t input_get_channel(input_t input, unsigned int channel);
+uint16_t input_get_raw(input_t input, unsigned int channel, uint64_t *time);
+uint64_t input_edge_time(input_t input);
+void input_mode(input_t input, input_mode_t mode);
+void input_stats(input_t input, input_stats_t *stats);
 void input_update(input_t input);
+int input_wait(input_t input, int timeout);
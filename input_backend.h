@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "input.h"
+
+// Pulses outside this range (microseconds) are noise, not a servo signal
+#define INPUT_PULSE_MIN 800
+#define INPUT_PULSE_MAX 2200
+
+// A PPM gap longer than this ends the frame (microseconds)
+#define INPUT_PPM_SYNC 2700
+
+// Pulses in the median filter. A glitch shorter than half the window never
+// reaches the value, and a step shows after (INPUT_MEDIAN + 1) / 2 pulses:
+// 40 ms at 50 Hz, against about 6 pulses for the 7:1 IIR to cross halfway.
+#define INPUT_MEDIAN 3
+
+// Each backend timestamps edges its own way and hands them to input_edge,
+// which decodes them into channel values
+struct input
+{
+	void (*update)(input_t input);
+
+	input_filter_t filter;
+	input_mode_t mode;
+	uint8_t new_weight;
+	uint8_t old_weight;
+	uint16_t values[INPUT_CHANNELS];
+
+	// Unfiltered widths: the latest, when it ended, and the median window
+	uint16_t raw[INPUT_CHANNELS];
+	uint64_t raw_time[INPUT_CHANNELS];
+	uint16_t history[INPUT_CHANNELS][INPUT_MEDIAN];
+	uint8_t history_length[INPUT_CHANNELS];
+	uint8_t history_next[INPUT_CHANNELS];
+
+	input_stats_t stats;
+
+	// Decoder: the last rising edge, and the PPM channel it starts, or
+	// INPUT_CHANNELS while waiting for a sync gap
+	uint64_t rise_time;
+	uint64_t edge_time;
+	uint8_t rising;
+	uint8_t channel;
+	uint8_t channels;
+
+	// Polled pin
+	uint8_t state;
+
+	// GPIO character device
+	int fd;
+	uint32_t seqno;
+};
+
+input_t input_alloc(void);
+void input_edge(input_t input, uint8_t level, uint64_t time);
+void input_lost(input_t input);
+uint64_t input_now(void);
+void input_set_error(const char *error);
@@ -0,0 +1,44 @@
+#include "input.h"
+#include "input_backend.h"
+
+#include <bcm2835.h>
+
+#define INPUT_PIN 4
+
+static void input_bcm2835_update(input_t input)
+{
+	uint8_t new_state = bcm2835_gpio_lev(INPUT_PIN);
+	if(new_state != input->state)
+	{
+		input_edge(input, new_state, input_now());
+		input->state = new_state;
+	}
+}
+
+input_t input_init(uint8_t old_weight, uint8_t new_weight)
+{
+	input_t input = 0;
+	int result;
+
+	result = bcm2835_init();
+	if(!result)
+	{
+		input_set_error("Failed to initialize BCM2835 library.");
+		goto fail;
+	}
+
+	input = input_alloc();
+	if(!input) goto fail;
+
+	bcm2835_gpio_fsel(INPUT_PIN, BCM2835_GPIO_FSEL_INPT);
+	input->state = bcm2835_gpio_lev(INPUT_PIN);
+
+	input->update = input_bcm2835_update;
+	input_filter(input, INPUT_FILTER_IIR, old_weight, new_weight);
+
+	return input;
+
+fail:	
+	input_deinit(input);
+	return 0;
+}
@@ -0,0 +1,240 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "input.h"
+
+// Servo frame period used when generating pulses, and the PPM frame period
+// and mark
+#define SIM_PERIOD_US 20000
+#define SIM_PPM_PERIOD_US 22500
+#define SIM_PPM_MARK_US 300
+
+static volatile sig_atomic_t _stop;
+
+static void on_signal(int signal)
+{
+	(void)signal;
+	_stop = 1;
+}
+
+static void sleep_until(struct timespec *time, uint32_t microseconds)
+{
+	time->tv_nsec += microseconds * 1000;
+	while(time->tv_nsec >= 1000000000)
+	{
+		time->tv_nsec -= 1000000000;
+		time->tv_sec++;
+	}
+
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, time, 0));
+}
+
+static void pull(int fd, int up)
+{
+	if(up && pwrite(fd, "pull-up", 7, 0) != 7) exit(1);
+	if(!up && pwrite(fd, "pull-down", 9, 0) != 9) exit(1);
+}
+
+// Drives a gpio-sim line through its pull attribute with servo pulses, or with
+// a PPM frame of the given channel widths
+static void simulate(const char *path, input_mode_t mode, const uint32_t *widths, int count)
+{
+	struct timespec time;
+	int fd = open(path, O_WRONLY);
+	int i;
+
+	if(fd < 0)
+	{
+		perror(path);
+		exit(1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	while(1)
+	{
+		uint32_t frame = 0;
+
+		if(mode == INPUT_MODE_PWM)
+		{
+			pull(fd, 1);
+			sleep_until(&time, widths[0]);
+
+			pull(fd, 0);
+			sleep_until(&time, SIM_PERIOD_US - widths[0]);
+			continue;
+		}
+
+		for(i = 0; i < count; i++)
+		{
+			pull(fd, 1);
+			sleep_until(&time, SIM_PPM_MARK_US);
+
+			pull(fd, 0);
+			sleep_until(&time, widths[i] - SIM_PPM_MARK_US);
+			frame += widths[i];
+		}
+
+		pull(fd, 1);
+		sleep_until(&time, SIM_PPM_MARK_US);
+
+		pull(fd, 0);
+		sleep_until(&time, SIM_PPM_PERIOD_US - frame - SIM_PPM_MARK_US);
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-m pwm|ppm] [-f none|iir|median] [-w old,new] [-s pull -p width[,width...]] chip line\n"
+		"  -m  signal on the line (default pwm)\n"
+		"  -f  filter (default iir)\n"
+		"  -w  IIR weights (default 7,1)\n"
+		"  -s  gpio-sim pull attribute of the line to drive with pulses\n"
+		"  -p  width of the driven pulses, or of each PPM channel, in microseconds\n"
+		"      (default 1500)\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	const char *sim = 0;
+	input_filter_t filter = INPUT_FILTER_IIR;
+	input_mode_t mode = INPUT_MODE_PWM;
+	unsigned int old_weight = 7, new_weight = 1;
+	uint32_t widths[INPUT_CHANNELS] = {1500}, frame = 0;
+	int count = 1, option, i;
+	char *token;
+
+	input_t input;
+	pid_t child = 0;
+	uint16_t last[INPUT_CHANNELS] = {0};
+	uint64_t updates = 0, changes = 0;
+
+	while((option = getopt(argc, argv, "f:m:p:s:w:")) != -1)
+	{
+		switch(option)
+		{
+			case 'f':
+				if(!strcmp(optarg, "none")) filter = INPUT_FILTER_NONE;
+				else if(!strcmp(optarg, "iir")) filter = INPUT_FILTER_IIR;
+				else if(!strcmp(optarg, "median")) filter = INPUT_FILTER_MEDIAN;
+				else
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+
+			case 'm':
+				if(!strcmp(optarg, "pwm")) mode = INPUT_MODE_PWM;
+				else if(!strcmp(optarg, "ppm")) mode = INPUT_MODE_PPM;
+				else
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+
+			case 'p':
+				count = 0;
+				for(token = strtok(optarg, ","); token && count < INPUT_CHANNELS; token = strtok(0, ","))
+					widths[count++] = atoi(token);
+				break;
+
+			case 's':
+				sim = optarg;
+				break;
+
+			case 'w':
+				if(sscanf(optarg, "%u,%u", &old_weight, &new_weight) != 2 || !(old_weight + new_weight))
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	for(i = 0; i < count; i++)
+		frame += widths[i];
+
+	if(optind != argc - 2 || !count || widths[0] >= SIM_PERIOD_US || (mode == INPUT_MODE_PPM && frame + SIM_PPM_MARK_US >= SIM_PPM_PERIOD_US))
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	input = input_open(argv[optind], atoi(argv[optind + 1]));
+	if(!input)
+	{
+		fprintf(stderr, "Fatal error: %s\n", input_error());
+		return 1;
+	}
+	input_filter(input, filter, old_weight, new_weight);
+	input_mode(input, mode);
+
+	if(sim)
+	{
+		child = fork();
+		if(!child) simulate(sim, mode, widths, count);
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	// Sleeps until an edge arrives; nothing runs between pulses
+	while(!_stop)
+	{
+		int changed = 0;
+
+		if(!input_wait(input, 1000)) continue;
+
+		input_update(input);
+		updates++;
+
+		for(i = 0; i < INPUT_CHANNELS; i++)
+		{
+			uint16_t value = input_get_channel(input, i);
+			if(value != last[i]) changed = 1;
+			last[i] = value;
+		}
+
+		if(changed)
+		{
+			printf("%u", last[0]);
+			for(i = 1; mode == INPUT_MODE_PPM && i < INPUT_CHANNELS && last[i]; i++)
+				printf(" %u", last[i]);
+			printf("\n");
+			fflush(stdout);
+
+			changes++;
+		}
+	}
+
+	if(child > 0)
+	{
+		kill(child, SIGTERM);
+		waitpid(child, 0, 0);
+	}
+
+	{
+		input_stats_t stats;
+		input_stats(input, &stats);
+
+		fprintf(stderr, "%llu wakeups, %llu changes\n", (unsigned long long)updates, (unsigned long long)changes);
+		fprintf(stderr, "%u pulses, %u rejected, %u edges lost\n", stats.pulses, stats.rejected, stats.lost);
+	}
+	input_deinit(input);
+
+	return 0;
+}
@@ -0,0 +1,609 @@
+#include "mp4.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Media timescale, and the frame duration assumed when there is nothing to
+// measure it from (ticks)
+#define MP4_TIMESCALE 90000
+#define MP4_DURATION (MP4_TIMESCALE / 30)
+
+// Samples in a fragment, and NAL units in a sample
+#define MP4_SAMPLES 256
+#define MP4_NALS 64
+
+// Longest SPS or PPS kept from the config buffer
+#define MP4_PARAMETER_MAX 128
+
+#define MP4_HEADER_MAX (1024 + 2 * MP4_PARAMETER_MAX)
+#define MP4_MOOF_MAX (128 + MP4_SAMPLES * 12)
+
+// A streaming fragmented MP4 muxer for one H.264 track. Each segment file
+// starts with the header (ftyp and a moov with no samples), and every fragment
+// after it is a moof and mdat that stand on their own, so a file cut short
+// plays up to its last whole fragment.
+//
+// Annex B frames are gathered in the buffer until the caller writes them out
+// as a fragment, normally at the next keyframe. Each frame is rewritten in
+// place with length prefixes as it ends.
+struct mp4
+{
+	uint8_t *data;
+	size_t size;
+	size_t length;
+	size_t frame_offset;
+
+	struct
+	{
+		uint32_t size;
+		int64_t time;
+		uint8_t keyframe;
+	} samples[MP4_SAMPLES];
+	unsigned int count;
+
+	// Decode times start from zero in each segment
+	int64_t base_time;
+	int based;
+	uint32_t duration_last;
+	uint32_t sequence;
+
+	unsigned int width;
+	unsigned int height;
+	uint8_t sps[MP4_PARAMETER_MAX];
+	size_t sps_length;
+	uint8_t pps[MP4_PARAMETER_MAX];
+	size_t pps_length;
+
+	uint8_t header[MP4_HEADER_MAX];
+	uint8_t moof[MP4_MOOF_MAX];
+};
+
+static const char *_error;
+
+static uint8_t *mp4_u8(uint8_t *p, uint8_t value)
+{
+	*p++ = value;
+	return p;
+}
+
+static uint8_t *mp4_u16(uint8_t *p, uint16_t value)
+{
+	*p++ = value >> 8;
+	*p++ = value;
+	return p;
+}
+
+static uint8_t *mp4_u32(uint8_t *p, uint32_t value)
+{
+	*p++ = value >> 24;
+	*p++ = value >> 16;
+	*p++ = value >> 8;
+	*p++ = value;
+	return p;
+}
+
+static uint8_t *mp4_u64(uint8_t *p, uint64_t value)
+{
+	p = mp4_u32(p, value >> 32);
+	return mp4_u32(p, value);
+}
+
+static uint8_t *mp4_bytes(uint8_t *p, const void *data, size_t length)
+{
+	memcpy(p, data, length);
+	return p + length;
+}
+
+static uint8_t *mp4_zeros(uint8_t *p, size_t length)
+{
+	memset(p, 0, length);
+	return p + length;
+}
+
+// A box's size is filled in by mp4_end once its contents are written
+static uint8_t *mp4_box(uint8_t *p, const char *type)
+{
+	p = mp4_u32(p, 0);
+	return mp4_bytes(p, type, 4);
+}
+
+static uint8_t *mp4_full_box(uint8_t *p, const char *type, uint8_t version, uint32_t flags)
+{
+	p = mp4_box(p, type);
+	return mp4_u32(p, (uint32_t)version << 24 | flags);
+}
+
+static void mp4_end(uint8_t *box, const uint8_t *p)
+{
+	mp4_u32(box, p - box);
+}
+
+static uint8_t *mp4_matrix(uint8_t *p)
+{
+	static const uint32_t matrix[9] = {0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000};
+	int i;
+
+	for(i = 0; i < 9; i++)
+		p = mp4_u32(p, matrix[i]);
+
+	return p;
+}
+
+mp4_t mp4_init(size_t size, unsigned int width, unsigned int height)
+{
+	mp4_t mp4 = malloc(sizeof(struct mp4));
+	if(!mp4)
+	{
+		_error = "Failed to allocate MP4 object.";
+		goto fail;
+	}
+	memset(mp4, 0, sizeof(struct mp4));
+
+	mp4->size = size;
+	mp4->width = width;
+	mp4->height = height;
+	mp4->duration_last = MP4_DURATION;
+
+	mp4->data = malloc(size);
+	if(!mp4->data)
+	{
+		_error = "Failed to allocate MP4 fragment buffer.";
+		goto fail;
+	}
+
+	return mp4;
+
+fail:
+	mp4_deinit(mp4);
+	return 0;
+}
+
+void mp4_deinit(mp4_t mp4)
+{
+	if(mp4)
+	{
+		free(mp4->data);
+		free(mp4);
+	}
+}
+
+const char *mp4_error(void)
+{
+	return _error;
+}
+
+// Adds Annex B data to the frame being gathered; returns 1, adding nothing,
+// if it doesn't fit
+int mp4_append(mp4_t mp4, const void *data, size_t length)
+{
+	if(length > mp4->size - mp4->length)
+	{
+		_error = "MP4 fragment buffer is full.";
+		return 1;
+	}
+
+	memcpy(mp4->data + mp4->length, data, length);
+	mp4->length += length;
+	return 0;
+}
+
+// Takes the SPS and PPS from the encoder's Annex B config buffers, whether
+// they come together or one at a time
+int mp4_config(mp4_t mp4, const uint8_t *data, size_t length)
+{
+	size_t i = 0, start = 0, end;
+	int found = 0;
+
+	while(i < length)
+	{
+		// Each NAL runs from after one start code to the zeros of the next
+		while(i + 2 < length && !(data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1))
+			i++;
+
+		end = i + 2 < length ? i : length;
+		while(end > start && !data[end - 1])
+			end--;
+
+		if(start && end > start && end - start <= MP4_PARAMETER_MAX)
+		{
+			switch(data[start] & 0x1f)
+			{
+				case 7:
+					memcpy(mp4->sps, data + start, end - start);
+					mp4->sps_length = end - start;
+					found = 1;
+					break;
+
+				case 8:
+					memcpy(mp4->pps, data + start, end - start);
+					mp4->pps_length = end - start;
+					found = 1;
+					break;
+			}
+		}
+
+		i += 3;
+		start = i;
+	}
+
+	if(!found)
+	{
+		_error = "MP4 config has no SPS or PPS.";
+		return 1;
+	}
+
+	return 0;
+}
+
+// Drops the frame being gathered
+void mp4_discard(mp4_t mp4)
+{
+	mp4->length = mp4->frame_offset;
+}
+
+static uint32_t mp4_ticks(mp4_t mp4, int64_t time)
+{
+	return (uint64_t)(time - mp4->base_time) * MP4_TIMESCALE / 1000000;
+}
+
+// Describes the whole frames gathered as a fragment, whose header and then
+// payload the caller writes out before calling mp4_release. next_time is when
+// the frame after them starts, or INT64_MIN if unknown, to time the last one.
+int mp4_fragment(mp4_t mp4, int64_t next_time, mp4_fragment_t *fragment)
+{
+	uint8_t *p = mp4->moof, *moof, *traf, *trun, *offset, *box;
+	unsigned int i;
+
+	if(!mp4->count)
+	{
+		_error = "MP4 fragment has no samples.";
+		return 1;
+	}
+
+	moof = p;
+	p = mp4_box(p, "moof");
+	{
+		box = p;
+		p = mp4_full_box(p, "mfhd", 0, 0);
+		p = mp4_u32(p, mp4->sequence++);
+		mp4_end(box, p);
+
+		traf = p;
+		p = mp4_box(p, "traf");
+		{
+			// Sample offsets count from the start of the moof
+			box = p;
+			p = mp4_full_box(p, "tfhd", 0, 0x020000);
+			p = mp4_u32(p, 1);
+			mp4_end(box, p);
+
+			box = p;
+			p = mp4_full_box(p, "tfdt", 1, 0);
+			p = mp4_u64(p, mp4_ticks(mp4, mp4->samples[0].time));
+			mp4_end(box, p);
+
+			// Duration, size and flags of each sample
+			trun = p;
+			p = mp4_full_box(p, "trun", 0, 0x000701);
+			p = mp4_u32(p, mp4->count);
+			offset = p;
+			p = mp4_u32(p, 0);
+
+			for(i = 0; i < mp4->count; i++)
+			{
+				uint32_t start = mp4_ticks(mp4, mp4->samples[i].time);
+				uint32_t end;
+
+				if(i + 1 < mp4->count) end = mp4_ticks(mp4, mp4->samples[i + 1].time);
+				else if(next_time != INT64_MIN) end = mp4_ticks(mp4, next_time);
+				else end = start + mp4->duration_last;
+
+				if((int32_t)(end - start) > 0) mp4->duration_last = end - start;
+
+				p = mp4_u32(p, mp4->duration_last);
+				p = mp4_u32(p, mp4->samples[i].size);
+				p = mp4_u32(p, mp4->samples[i].keyframe ? 0x02000000 : 0x01010000);
+			}
+			mp4_end(trun, p);
+		}
+		mp4_end(traf, p);
+	}
+	mp4_end(moof, p);
+
+	// The mdat header follows straight after
+	mp4_u32(offset, p - moof + 8);
+	p = mp4_u32(p, mp4->frame_offset + 8);
+	p = mp4_bytes(p, "mdat", 4);
+
+	fragment->header = mp4->moof;
+	fragment->header_length = p - mp4->moof;
+	fragment->payload = mp4->data;
+	fragment->payload_length = mp4->frame_offset;
+	fragment->samples = mp4->count;
+	fragment->keyframe = mp4->samples[0].keyframe;
+
+	return 0;
+}
+
+// Ends the frame being gathered, rewriting its start codes as lengths; returns
+// 1 if it can't be added to the fragment, leaving it to be discarded or
+// retried once the fragment is out
+int mp4_frame(mp4_t mp4, int64_t time, int keyframe)
+{
+	struct
+	{
+		size_t in;
+		size_t out;
+		size_t length;
+	} nals[MP4_NALS];
+	uint8_t *frame = mp4->data + mp4->frame_offset;
+	size_t length = mp4->length - mp4->frame_offset;
+	size_t i, zeros = 0, out = 0;
+	unsigned int count = 0, n;
+
+	if(mp4->count == MP4_SAMPLES)
+	{
+		_error = "MP4 fragment has too many samples.";
+		return 1;
+	}
+
+	for(i = 0; i < length; i++)
+	{
+		if(frame[i] == 1 && zeros >= 2)
+		{
+			if(count && (nals[count - 1].length = i - zeros - nals[count - 1].in))
+				out += 4 + nals[count - 1].length;
+			else if(count)
+				count--;
+
+			if(count == MP4_NALS)
+			{
+				_error = "MP4 frame has too many NAL units.";
+				return 1;
+			}
+
+			nals[count].in = i + 1;
+			nals[count].out = out + 4;
+			count++;
+		}
+
+		zeros = frame[i] ? 0 : zeros + 1;
+	}
+
+	if(!count || nals[0].in > 4)
+	{
+		_error = "MP4 frame is not Annex B.";
+		return 1;
+	}
+
+	if(!(nals[count - 1].length = length - nals[count - 1].in))
+		count--;
+	else
+		out += 4 + nals[count - 1].length;
+
+	if(!count || out > mp4->size - mp4->frame_offset)
+	{
+		_error = "MP4 frame doesn't fit.";
+		return 1;
+	}
+
+	// Units moving back go first, front to back, then those moving forward,
+	// back to front, so none overwrites one that hasn't moved yet
+	for(n = 0; n < count; n++)
+	{
+		if(nals[n].out > nals[n].in) continue;
+		memmove(frame + nals[n].out, frame + nals[n].in, nals[n].length);
+		mp4_u32(frame + nals[n].out - 4, nals[n].length);
+	}
+
+	for(n = count; n-- > 0;)
+	{
+		if(nals[n].out <= nals[n].in) continue;
+		memmove(frame + nals[n].out, frame + nals[n].in, nals[n].length);
+		mp4_u32(frame + nals[n].out - 4, nals[n].length);
+	}
+
+	if(!mp4->based)
+	{
+		mp4->base_time = time;
+		mp4->based = 1;
+	}
+
+	mp4->samples[mp4->count].size = out;
+	mp4->samples[mp4->count].time = time;
+	mp4->samples[mp4->count].keyframe = keyframe;
+	mp4->count++;
+
+	mp4->frame_offset += out;
+	mp4->length = mp4->frame_offset;
+
+	return 0;
+}
+
+// Builds the header each segment starts with, and restarts the timeline for
+// the fragments after it. Returns 0 until the config has arrived.
+size_t mp4_header(mp4_t mp4, const uint8_t **header)
+{
+	uint8_t *p = mp4->header, *moov, *trak, *mdia, *minf, *dinf, *stbl, *stsd, *avc1, *avcc, *mvex, *box;
+	uint8_t profile = mp4->sps[1];
+
+	if(mp4->sps_length < 4 || !mp4->pps_length)
+	{
+		_error = "MP4 header needs the encoder config.";
+		return 0;
+	}
+
+	mp4->based = 0;
+	mp4->sequence = 1;
+
+	box = p;
+	p = mp4_box(p, "ftyp");
+	p = mp4_bytes(p, "isom", 4);
+	p = mp4_u32(p, 0x200);
+	p = mp4_bytes(p, "isomiso6avc1mp41", 16);
+	mp4_end(box, p);
+
+	moov = p;
+	p = mp4_box(p, "moov");
+
+	box = p;
+	p = mp4_full_box(p, "mvhd", 0, 0);
+	p = mp4_zeros(p, 8);
+	p = mp4_u32(p, 1000);
+	p = mp4_u32(p, 0);
+	p = mp4_u32(p, 0x00010000);
+	p = mp4_u16(p, 0x0100);
+	p = mp4_zeros(p, 10);
+	p = mp4_matrix(p);
+	p = mp4_zeros(p, 24);
+	p = mp4_u32(p, 2);
+	mp4_end(box, p);
+
+	trak = p;
+	p = mp4_box(p, "trak");
+
+	box = p;
+	p = mp4_full_box(p, "tkhd", 0, 0x000003);
+	p = mp4_zeros(p, 8);
+	p = mp4_u32(p, 1);
+	p = mp4_zeros(p, 4 + 4 + 8 + 2 + 2 + 2 + 2);
+	p = mp4_matrix(p);
+	p = mp4_u32(p, mp4->width << 16);
+	p = mp4_u32(p, mp4->height << 16);
+	mp4_end(box, p);
+
+	mdia = p;
+	p = mp4_box(p, "mdia");
+
+	box = p;
+	p = mp4_full_box(p, "mdhd", 0, 0);
+	p = mp4_zeros(p, 8);
+	p = mp4_u32(p, MP4_TIMESCALE);
+	p = mp4_u32(p, 0);
+	p = mp4_u16(p, 0x55c4);
+	p = mp4_u16(p, 0);
+	mp4_end(box, p);
+
+	box = p;
+	p = mp4_full_box(p, "hdlr", 0, 0);
+	p = mp4_u32(p, 0);
+	p = mp4_bytes(p, "vide", 4);
+	p = mp4_zeros(p, 12);
+	p = mp4_bytes(p, "VideoHandler", 13);
+	mp4_end(box, p);
+
+	minf = p;
+	p = mp4_box(p, "minf");
+
+	box = p;
+	p = mp4_full_box(p, "vmhd", 0, 1);
+	p = mp4_zeros(p, 8);
+	mp4_end(box, p);
+
+	dinf = p;
+	p = mp4_box(p, "dinf");
+	box = p;
+	p = mp4_full_box(p, "dref", 0, 0);
+	p = mp4_u32(p, 1);
+	p = mp4_full_box(p, "url ", 0, 1);
+	mp4_end(p - 12, p);
+	mp4_end(box, p);
+	mp4_end(dinf, p);
+
+	stbl = p;
+	p = mp4_box(p, "stbl");
+
+	stsd = p;
+	p = mp4_full_box(p, "stsd", 0, 0);
+	p = mp4_u32(p, 1);
+
+	avc1 = p;
+	p = mp4_box(p, "avc1");
+	p = mp4_zeros(p, 6);
+	p = mp4_u16(p, 1);
+	p = mp4_zeros(p, 16);
+	p = mp4_u16(p, mp4->width);
+	p = mp4_u16(p, mp4->height);
+	p = mp4_u32(p, 0x00480000);
+	p = mp4_u32(p, 0x00480000);
+	p = mp4_u32(p, 0);
+	p = mp4_u16(p, 1);
+	p = mp4_zeros(p, 32);
+	p = mp4_u16(p, 0x0018);
+	p = mp4_u16(p, 0xffff);
+
+	// Four-byte lengths, one SPS and one PPS
+	avcc = p;
+	p = mp4_box(p, "avcC");
+	p = mp4_u8(p, 1);
+	p = mp4_bytes(p, mp4->sps + 1, 3);
+	p = mp4_u8(p, 0xff);
+	p = mp4_u8(p, 0xe1);
+	p = mp4_u16(p, mp4->sps_length);
+	p = mp4_bytes(p, mp4->sps, mp4->sps_length);
+	p = mp4_u8(p, 1);
+	p = mp4_u16(p, mp4->pps_length);
+	p = mp4_bytes(p, mp4->pps, mp4->pps_length);
+
+	// High profiles add the chroma format and bit depths: 4:2:0, 8 bits
+	if(profile == 100 || profile == 110 || profile == 122 || profile == 144)
+	{
+		p = mp4_u8(p, 0xfd);
+		p = mp4_u8(p, 0xf8);
+		p = mp4_u8(p, 0xf8);
+		p = mp4_u8(p, 0);
+	}
+	mp4_end(avcc, p);
+	mp4_end(avc1, p);
+	mp4_end(stsd, p);
+
+	// Samples are all in the fragments
+	box = p;
+	p = mp4_full_box(p, "stts", 0, 0);
+	p = mp4_u32(p, 0);
+	mp4_end(box, p);
+
+	box = p;
+	p = mp4_full_box(p, "stsc", 0, 0);
+	p = mp4_u32(p, 0);
+	mp4_end(box, p);
+
+	box = p;
+	p = mp4_full_box(p, "stsz", 0, 0);
+	p = mp4_zeros(p, 8);
+	mp4_end(box, p);
+
+	box = p;
+	p = mp4_full_box(p, "stco", 0, 0);
+	p = mp4_u32(p, 0);
+	mp4_end(box, p);
+
+	mp4_end(stbl, p);
+	mp4_end(minf, p);
+	mp4_end(mdia, p);
+	mp4_end(trak, p);
+
+	mvex = p;
+	p = mp4_box(p, "mvex");
+	box = p;
+	p = mp4_full_box(p, "trex", 0, 0);
+	p = mp4_u32(p, 1);
+	p = mp4_u32(p, 1);
+	p = mp4_zeros(p, 12);
+	mp4_end(box, p);
+	mp4_end(mvex, p);
+
+	mp4_end(moov, p);
+
+	*header = mp4->header;
+	return p - mp4->header;
+}
+
+// Drops the fragment just written, keeping the frame being gathered
+void mp4_release(mp4_t mp4)
+{
+	memmove(mp4->data, mp4->data + mp4->frame_offset, mp4->length - mp4->frame_offset);
+	mp4->length -= mp4->frame_offset;
+	mp4->frame_offset = 0;
+	mp4->count = 0;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct
+{
+	const uint8_t *header;
+	size_t header_length;
+	const uint8_t *payload;
+	size_t payload_length;
+	unsigned int samples;
+	int keyframe;
+} mp4_fragment_t;
+
+typedef struct mp4 *mp4_t;
+
+mp4_t mp4_init(size_t size, unsigned int width, unsigned int height);
+void mp4_deinit(mp4_t mp4);
+const char *mp4_error(void);
+
+int mp4_append(mp4_t mp4, const void *data, size_t length);
+int mp4_config(mp4_t mp4, const uint8_t *data, size_t length);
+void mp4_discard(mp4_t mp4);
+int mp4_fragment(mp4_t mp4, int64_t next_time, mp4_fragment_t *fragment);
+int mp4_frame(mp4_t mp4, int64_t time, int keyframe);
+size_t mp4_header(mp4_t mp4, const uint8_t **header);
+void mp4_release(mp4_t mp4);
@@ -57,6 +57,15 @@ struct osd
 	uint16_t voltage;
 	uint8_t cells;
 	uint8_t recording;
+
+	int16_t vspeed;
+	uint16_t cell_min;
+	uint16_t consumed;
+	uint16_t home_distance;
+	uint16_t home_bearing;
+	uint8_t home_set;
+
+	uint8_t page;
 };
 
 typedef struct
@@ -246,6 +255,24 @@ void osd_deinit_gl(osd_t osd)
 	osd_deinit_gl_font(osd);
 }
 
+// The GL context is current on one thread at a time. The thread that called
+// osd_init hands it over by calling osd_detach before the renderer attaches.
+int osd_attach(osd_t osd)
+{
+	if(eglMakeCurrent(osd->display, osd->surface, osd->surface, osd->context) == EGL_FALSE)
+	{
+		_error = "Failed to activate EGL display.";
+		return 1;
+	}
+
+	return 0;
+}
+
+void osd_detach(osd_t osd)
+{
+	eglMakeCurrent(osd->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+}
+
 void osd_deinit(osd_t osd)
 {
 	if(osd)
@@ -668,11 +695,33 @@ void osd_set_altitude(osd_t osd, int32_t altitude)
 	osd->altitude = altitude;
 }
 
+void osd_set_cell_min(osd_t osd, uint16_t voltage)
+{
+	osd->cell_min = voltage;
+}
+
+void osd_set_consumed(osd_t osd, uint16_t consumed)
+{
+	osd->consumed = consumed;
+}
+
 void osd_set_heading(osd_t osd, uint16_t heading)
 {
 	osd->heading = heading;
 }
 
+void osd_set_home(osd_t osd, uint16_t distance, uint16_t bearing)
+{
+	osd->home_distance = distance;
+	osd->home_bearing = bearing;
+	osd->home_set = 1;
+}
+
+void osd_set_page(osd_t osd, uint8_t page)
+{
+	osd->page = page;
+}
+
 void osd_set_recording(osd_t osd, uint8_t recording)
 {
 	osd->recording = recording;
@@ -684,11 +733,17 @@ void osd_set_voltage(osd_t osd, uint16_t voltage, uint8_t cells)
 	osd->voltage = voltage;
 }
 
+void osd_set_vspeed(osd_t osd, int16_t vspeed)
+{
+	osd->vspeed = vspeed;
+}
+
 void osd_update(osd_t osd)
 {
 	glClear(GL_COLOR_BUFFER_BIT);
 
 	glBindTexture(GL_TEXTURE_2D, osd->font_texture);
+	if(osd->page < 2)
 	{
 		int16_t whole = osd->altitude / 100;
 		uint16_t frac = (osd->altitude >= 0 ? osd->altitude : -osd->altitude) % 100;
@@ -719,7 +774,9 @@ void osd_update(osd_t osd)
 			.scale = 2.0f,
 		};
 		
-		if(osd->cells)
+		if(osd->cell_min)
+			cell_voltage = osd->cell_min;
+		else if(osd->cells)
 			cell_voltage = osd->voltage / osd->cells;
 		else
 			cell_voltage = osd->voltage;
@@ -742,9 +799,10 @@ void osd_update(osd_t osd)
 			draw.color = (color_t){255, 255, 0, 255};
 		}
 
-		draw_string(&draw);
+		if(osd->page < 2) draw_string(&draw);
 	}
 	
+	if(!osd->page)
 	{
 		char buffer[8];
 		sprintf(buffer, "HDG %03u", osd->heading / 100);
@@ -759,6 +817,76 @@ void osd_update(osd_t osd)
 		draw_string(&draw);
 	}
 
+	if(!osd->page)
+	{
+		uint16_t magnitude = osd->vspeed >= 0 ? osd->vspeed : -osd->vspeed;
+
+		char buffer[15];
+		sprintf(buffer, "VSI %c%2u.%u m/s", osd->vspeed >= 0 ? '+' : '-', magnitude / 100, (magnitude % 100) / 10);
+
+		draw_string_t draw = {
+			.string = buffer,
+			.origin = {MARGIN_LEFT, 6 * FNT_CELL_HEIGHT + MARGIN_TOP},
+			.anchor = {0, 0},
+			.color = {255, 255, 255, 255},
+			.scale = 2.0f,
+		};
+		draw_string(&draw);
+	}
+
+	if(!osd->page)
+	{
+		char buffer[14];
+
+		if(osd->cell_min)
+			sprintf(buffer, "CEL %u.%02u V", osd->cell_min / 1000, (osd->cell_min % 1000) / 10);
+		else
+			sprintf(buffer, "CEL ---");
+
+		draw_string_t draw = {
+			.string = buffer,
+			.origin = {MARGIN_LEFT, 8 * FNT_CELL_HEIGHT + MARGIN_TOP},
+			.anchor = {0, 0},
+			.color = {255, 255, 255, 255},
+			.scale = 2.0f,
+		};
+		draw_string(&draw);
+	}
+
+	if(!osd->page)
+	{
+		char buffer[14];
+		sprintf(buffer, "USE %5u mAh", osd->consumed);
+
+		draw_string_t draw = {
+			.string = buffer,
+			.origin = {MARGIN_LEFT, 10 * FNT_CELL_HEIGHT + MARGIN_TOP},
+			.anchor = {0, 0},
+			.color = {255, 255, 255, 255},
+			.scale = 2.0f,
+		};
+		draw_string(&draw);
+	}
+
+	if(!osd->page)
+	{
+		char buffer[17];
+
+		if(osd->home_set)
+			sprintf(buffer, "HOM %5u m %03u", osd->home_distance, osd->home_bearing);
+		else
+			sprintf(buffer, "HOM ---");
+
+		draw_string_t draw = {
+			.string = buffer,
+			.origin = {MARGIN_LEFT, 12 * FNT_CELL_HEIGHT + MARGIN_TOP},
+			.anchor = {0, 0},
+			.color = {255, 255, 255, 255},
+			.scale = 2.0f,
+		};
+		draw_string(&draw);
+	}
+
 	if(osd->recording)
 	{
 		glBindTexture(GL_TEXTURE_2D, osd->rec_texture);
@@ -2,14 +2,25 @@
 
 #include <stdint.h>
 
+// Pages of the OSD: everything, altitude and battery only, warnings only
+#define OSD_PAGES 3
+
 typedef struct osd *osd_t;
 
 osd_t osd_init(void);
 void osd_deinit(osd_t osd);
 const char *osd_error(void);
 
+int osd_attach(osd_t osd);
+void osd_detach(osd_t osd);
+
 void osd_set_altitude(osd_t osd, int32_t altitude);
+void osd_set_cell_min(osd_t osd, uint16_t voltage);
+void osd_set_consumed(osd_t osd, uint16_t consumed);
 void osd_set_heading(osd_t osd, uint16_t heading);
+void osd_set_home(osd_t osd, uint16_t distance, uint16_t bearing);
+void osd_set_page(osd_t osd, uint8_t page);
 void osd_set_recording(osd_t osd, uint8_t recording);
 void osd_set_voltage(osd_t osd, uint16_t voltage, uint8_t cells);
+void osd_set_vspeed(osd_t osd, int16_t vspeed);
 void osd_update(osd_t osd);
@@ -0,0 +1,152 @@
+#include "ring.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define RING_CACHE_LINE 64
+
+// A single-producer, single-consumer queue of fixed-size items. The producer
+// owns head and the statistics, the consumer owns tail, and each only reads
+// the other's index. Indices run freely and wrap through the power-of-two
+// capacity.
+//
+// The eventfd is signalled when an item lands in a ring the consumer has
+// emptied, so the consumer can sleep in poll(). It must call ring_acknowledge
+// before draining the ring with ring_pop, so an item pushed after the drain
+// signals again. Publishing an index and then reading the other one is
+// sequentially consistent on both sides, so either the producer sees the
+// consumer caught up and signals, or the consumer sees the new item.
+struct ring
+{
+	_Alignas(RING_CACHE_LINE) atomic_uint head;
+	ring_stats_t stats;
+
+	_Alignas(RING_CACHE_LINE) atomic_uint tail;
+
+	_Alignas(RING_CACHE_LINE) unsigned int mask;
+	size_t item_size;
+	int fd;
+	uint8_t *items;
+};
+
+static const char *_error;
+
+ring_t ring_init(unsigned int capacity, size_t item_size)
+{
+	ring_t ring = 0;
+
+	if(!capacity || (capacity & (capacity - 1)))
+	{
+		_error = "Ring capacity must be a power of two.";
+		goto fail;
+	}
+
+	if(posix_memalign((void **)&ring, RING_CACHE_LINE, sizeof(struct ring)))
+	{
+		ring = 0;
+		_error = "Failed to allocate ring object.";
+		goto fail;
+	}
+	memset(ring, 0, sizeof(struct ring));
+
+	ring->mask = capacity - 1;
+	ring->item_size = item_size;
+
+	ring->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if(ring->fd < 0)
+	{
+		_error = "Failed to create ring event.";
+		goto fail;
+	}
+
+	ring->items = malloc((size_t)capacity * item_size);
+	if(!ring->items)
+	{
+		_error = "Failed to allocate ring items.";
+		goto fail;
+	}
+
+	return ring;
+
+fail:
+	ring_deinit(ring);
+	return 0;
+}
+
+void ring_deinit(ring_t ring)
+{
+	if(ring)
+	{
+		if(ring->fd >= 0) close(ring->fd);
+		free(ring->items);
+		free(ring);
+	}
+}
+
+const char *ring_error(void)
+{
+	return _error;
+}
+
+void ring_acknowledge(ring_t ring)
+{
+	eventfd_t count;
+	eventfd_read(ring->fd, &count);
+}
+
+unsigned int ring_depth(ring_t ring)
+{
+	return atomic_load_explicit(&ring->head, memory_order_acquire) - atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+int ring_fd(ring_t ring)
+{
+	return ring->fd;
+}
+
+// Returns 1 with the oldest item, or 0 if the ring is empty
+int ring_pop(ring_t ring, void *item)
+{
+	unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	unsigned int head = atomic_load(&ring->head);
+
+	if(head == tail) return 0;
+
+	memcpy(item, ring->items + (size_t)(tail & ring->mask) * ring->item_size, ring->item_size);
+	atomic_store(&ring->tail, tail + 1);
+
+	return 1;
+}
+
+// Returns 0, or 1 if the ring was full and the item was dropped
+int ring_push(ring_t ring, const void *item)
+{
+	unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	unsigned int depth = head - tail;
+
+	if(depth > ring->mask)
+	{
+		ring->stats.dropped++;
+		return 1;
+	}
+
+	memcpy(ring->items + (size_t)(head & ring->mask) * ring->item_size, item, ring->item_size);
+	atomic_store(&ring->head, head + 1);
+
+	ring->stats.pushed++;
+	if(depth + 1 > ring->stats.depth_max) ring->stats.depth_max = depth + 1;
+
+	if(atomic_load(&ring->tail) == head) eventfd_write(ring->fd, 1);
+
+	return 0;
+}
+
+// Read from another thread the counts may be a push behind
+void ring_stats(ring_t ring, ring_stats_t *stats)
+{
+	*stats = ring->stats;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct
+{
+	uint32_t pushed;
+	uint32_t dropped;
+	uint32_t depth_max;
+} ring_stats_t;
+
+typedef struct ring *ring_t;
+
+ring_t ring_init(unsigned int capacity, size_t item_size);
+void ring_deinit(ring_t ring);
+const char *ring_error(void);
+
+void ring_acknowledge(ring_t ring);
+unsigned int ring_depth(ring_t ring);
+int ring_fd(ring_t ring);
+int ring_pop(ring_t ring, void *item);
+int ring_push(ring_t ring, const void *item);
+void ring_stats(ring_t ring, ring_stats_t *stats);
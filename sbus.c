@@ -0,0 +1,181 @@
+#include "sbus.h"
+#include "serial.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SBUS_BAUD 100000
+#define SBUS_FRAME 25
+#define SBUS_HEADER 0x0f
+
+#define SBUS_FLAG_FRAME_LOST 0x04
+#define SBUS_FLAG_FAILSAFE 0x08
+
+// Raw channel values map 172-1811 onto 988-2012 us
+#define SBUS_RAW_CENTER 992
+#define SBUS_US_CENTER 1500
+
+struct sbus
+{
+	int fd;
+
+	uint8_t input[2 * SBUS_FRAME];
+	size_t input_length;
+
+	uint16_t channels[SBUS_CHANNELS];
+	uint8_t flags;
+	uint8_t valid;
+};
+
+static const char *_error;
+
+void sbus_close(sbus_t sbus)
+{
+	if(sbus)
+	{
+		if(sbus->fd >= 0) close(sbus->fd);
+		free(sbus);
+	}
+}
+
+const char *sbus_error(void)
+{
+	return _error;
+}
+
+sbus_t sbus_open(const char *device)
+{
+	sbus_t sbus = malloc(sizeof(struct sbus));
+	if(!sbus)
+	{
+		_error = "Failed to allocate SBUS object.";
+		return 0;
+	}
+
+	memset(sbus, 0, sizeof(struct sbus));
+
+	// The Pi's UARTs can't invert, so the line needs an external inverter or
+	// a receiver with uninverted SBUS output
+	sbus->fd = open(device, O_NDELAY | O_NOCTTY | O_RDONLY);
+	if(sbus->fd < 0)
+	{
+		_error = strerror(errno);
+		goto fail;
+	}
+
+	if(serial_configure(sbus->fd, SBUS_BAUD, SERIAL_8E2, SBUS_FRAME))
+	{
+		_error = "Failed to configure SBUS port.";
+		goto fail;
+	}
+	serial_flush(sbus->fd);
+
+	return sbus;
+
+fail:
+	sbus_close(sbus);
+	return 0;
+}
+
+int sbus_fd(sbus_t sbus)
+{
+	return sbus->fd;
+}
+
+uint16_t sbus_get_channel(sbus_t sbus, unsigned int channel)
+{
+	if(!sbus->valid || channel >= SBUS_CHANNELS) return 0;
+	return sbus->channels[channel];
+}
+
+int sbus_failsafe(sbus_t sbus)
+{
+	return (sbus->flags & SBUS_FLAG_FAILSAFE) != 0;
+}
+
+int sbus_frame_lost(sbus_t sbus)
+{
+	return (sbus->flags & SBUS_FLAG_FRAME_LOST) != 0;
+}
+
+// The 16 11-bit channels are packed LSB first into bytes 1-22; shifting whole
+// bytes into an accumulator yields each channel in one step
+static void sbus_decode(sbus_t sbus, const uint8_t *frame)
+{
+	const uint8_t *data = frame + 1;
+	uint32_t bits = 0;
+	unsigned int count = 0, i;
+
+	for(i = 0; i < SBUS_CHANNELS; i++)
+	{
+		int raw;
+
+		while(count < 11)
+		{
+			bits |= (uint32_t)*data++ << count;
+			count += 8;
+		}
+
+		raw = bits & 0x7ff;
+		bits >>= 11;
+		count -= 11;
+
+		sbus->channels[i] = SBUS_US_CENTER + (raw - SBUS_RAW_CENTER) * 5 / 8;
+	}
+
+	sbus->flags = frame[23];
+	sbus->valid = 1;
+}
+
+// SBUS2 receivers put the telemetry slot in the upper footer bits
+static int sbus_footer(uint8_t footer)
+{
+	return (footer & 0x0f) == 0x00 || (footer & 0x0f) == 0x04;
+}
+
+int sbus_update(sbus_t sbus)
+{
+	ssize_t count;
+	size_t start = 0;
+	int frames = 0;
+
+	while((count = read(sbus->fd, sbus->input + sbus->input_length, sizeof(sbus->input) - sbus->input_length)) > 0)
+	{
+		sbus->input_length += count;
+
+		while(sbus->input_length - start >= SBUS_FRAME)
+		{
+			const uint8_t *frame = sbus->input + start;
+
+			if(frame[0] != SBUS_HEADER || !sbus_footer(frame[SBUS_FRAME - 1]))
+			{
+				start++;
+				continue;
+			}
+
+			sbus_decode(sbus, frame);
+			start += SBUS_FRAME;
+			frames++;
+		}
+
+		memmove(sbus->input, sbus->input + start, sbus->input_length - start);
+		sbus->input_length -= start;
+		start = 0;
+	}
+
+	return frames;
+}
+
+int sbus_wait(sbus_t sbus, int timeout)
+{
+	struct pollfd fd = {
+		.fd = sbus->fd,
+		.events = POLLIN,
+	};
+
+	return poll(&fd, 1, timeout) > 0;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+
+#define SBUS_CHANNELS 16
+
+typedef struct sbus *sbus_t;
+
+sbus_t sbus_open(const char *device);
+void sbus_close(sbus_t sbus);
+const char *sbus_error(void);
+
+int sbus_fd(sbus_t sbus);
+uint16_t sbus_get_channel(sbus_t sbus, unsigned int channel);
+int sbus_failsafe(sbus_t sbus);
+int sbus_frame_lost(sbus_t sbus);
+int sbus_update(sbus_t sbus);
+int sbus_wait(sbus_t sbus, int timeout);
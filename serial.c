@@ -0,0 +1,37 @@
+#include "serial.h"
+
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+
+// termios2 takes the baud rate as a number, so rates like 100000 and 420000
+// that have no Bxxx constant can be set too.
+int serial_configure(int fd, uint32_t baud, uint8_t format, uint8_t vmin)
+{
+	struct termios2 tio;
+
+	if(ioctl(fd, TCGETS2, &tio)) return 1;
+
+	// Raw mode
+	tio.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON | IXOFF | IXANY | INPCK);
+	tio.c_oflag &= ~OPOST;
+	tio.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+
+	tio.c_cflag &= ~(CSIZE | PARENB | PARODD | CSTOPB | CRTSCTS | CBAUD | (CBAUD << IBSHIFT));
+	tio.c_cflag |= CS8 | CREAD | CLOCAL | BOTHER | (BOTHER << IBSHIFT);
+	if(format == SERIAL_8E2) tio.c_cflag |= PARENB | CSTOPB;
+
+	tio.c_ispeed = baud;
+	tio.c_ospeed = baud;
+
+	// Reads and poll() wait for at least a minimum frame before waking
+	tio.c_cc[VMIN] = vmin;
+	tio.c_cc[VTIME] = 0;
+
+	if(ioctl(fd, TCSETS2, &tio)) return 1;
+	return 0;
+}
+
+void serial_flush(int fd)
+{
+	ioctl(fd, TCFLSH, TCIFLUSH);
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdint.h>
+
+#define SERIAL_8N1 0
+#define SERIAL_8E2 1
+
+int serial_configure(int fd, uint32_t baud, uint8_t format, uint8_t vmin);
+void serial_flush(int fd);
@@ -1,27 +1,129 @@
 #include "telem.h"
+#include "telem_protocol.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "serial.h"
+
+#define TELEM_BUFFER_SIZE 1024
+
+// Auto-detection accepts a configuration once this many frames decode within
+// the window, with fewer than half as many errors
+#define TELEM_DETECT_FRAMES 3
+#define TELEM_DETECT_WINDOW 250
+
+// A port's values give way to a lower priority port once it has sent none
+// for this long (microseconds)
+#define TELEM_SOURCE_TIMEOUT 1000000
+
+// Each port decodes its own stream into the shared value store
+struct telem_port
+{
+	const struct telem_protocol *protocol;
+	telem_protocol_t protocol_id;
+
+	uint32_t baud;
+	int fd;
+	uint8_t invert;
+	uint8_t priority;
+	uint8_t hangup;
+	telem_stats_t stats;
+
+	// First halves of split values, held until the second half arrives
+	uint16_t pending[8];
+	uint8_t pending_mask;
+	uint8_t paired_mask;
+
+	uint8_t input[TELEM_BUFFER_SIZE];
+	size_t input_length;
+};
+
 struct telem
 {
 	telem_callback_t callback;
 	void *callback_data;
 
-	int port;
-	uint16_t values[256];
+	struct
+	{
+		telem_batch_callback_t callback;
+		void *data;
+		telem_mask_t ids;
+	} subscribers[TELEM_SUBSCRIBERS];
 
-	uint8_t buffer[3];
-	uint8_t cells;
-	uint8_t escape;
-	uint8_t invert;
-	uint8_t state;
+	// IDs whose value changed during the last update
+	telem_mask_t changed;
+
+	// The first port is the one opened with the telem_t; the capture and the
+	// single-port calls apply to it
+	struct telem_port ports[TELEM_PORTS];
+	unsigned int port_count;
+	int capture;
+
+	// Port being decoded, or null while derived values are stored
+	struct telem_port *source;
+
+	// Which port last stored each ID, and when
+	uint8_t owner[256];
+	uint64_t owner_time[256];
+
+	// Values are published under a sequence lock: the count is odd while an
+	// update is writing, so readers on other threads retry instead of
+	// copying a half-written store.
+	atomic_uint sequence;
+	telem_snapshot_t published;
+
+	struct telem_derive derive;
+	uint64_t time;
+
+	uint8_t updates;
+};
+
+static const struct telem_protocol *const _protocols[] = {
+	[TELEM_PROTOCOL_HUB] = &telem_protocol_hub,
+	[TELEM_PROTOCOL_SPORT] = &telem_protocol_sport,
+	[TELEM_PROTOCOL_MAVLINK] = &telem_protocol_mavlink,
+	[TELEM_PROTOCOL_CRSF] = &telem_protocol_crsf,
+};
+
+// Values split across two IDs, in the order the hub protocol sends them
+static const struct
+{
+	uint8_t first, second;
+} _pairs[] = {
+	{TELEM_ID_ALT, TELEM_ID_ALT_FRAC},
+	{TELEM_ID_GPS_ALT, TELEM_ID_GPS_ALT_FRAC},
+	{TELEM_ID_GPS_LAT, TELEM_ID_GPS_LAT_FRAC},
+	{TELEM_ID_GPS_LON, TELEM_ID_GPS_LON_FRAC},
+	{TELEM_ID_GPS_SPEED, TELEM_ID_GPS_SPEED_FRAC},
+	{TELEM_ID_HEADING, TELEM_ID_HEADING_FRAC},
+};
+
+#define TELEM_PAIRS (sizeof(_pairs) / sizeof(_pairs[0]))
+
+// Configurations tried by telem_detect, in order
+static const struct
+{
+	telem_protocol_t protocol;
+	uint32_t baud;
+} _candidates[] = {
+	{TELEM_PROTOCOL_HUB, 9600},
+	{TELEM_PROTOCOL_SPORT, 57600},
+	{TELEM_PROTOCOL_MAVLINK, 57600},
+	{TELEM_PROTOCOL_MAVLINK, 115200},
+	{TELEM_PROTOCOL_CRSF, 420000},
 };
 
+#define TELEM_CANDIDATES (sizeof(_candidates) / sizeof(_candidates[0]))
+
 static const char *_error = 0;
 
 void telem_callback(telem_t telem, telem_callback_t callback, void *data)
@@ -30,11 +132,80 @@ void telem_callback(telem_t telem, telem_callback_t callback, void *data)
 	telem->callback_data = data;
 }
 
+const telem_mask_t *telem_changed(telem_t telem)
+{
+	return &telem->changed;
+}
+
+int telem_capture(telem_t telem, const char *path)
+{
+	telem_capture_header_t header = {
+		.magic = TELEM_CAPTURE_MAGIC,
+		.version = TELEM_CAPTURE_VERSION,
+		.protocol = telem->ports[0].protocol_id,
+		.invert = telem->ports[0].invert,
+	};
+
+	if(telem->capture >= 0)
+	{
+		close(telem->capture);
+		telem->capture = -1;
+	}
+
+	if(!path) return 0;
+
+	telem->capture = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(telem->capture < 0)
+	{
+		_error = strerror(errno);
+		return 1;
+	}
+
+	if(write(telem->capture, &header, sizeof(header)) != sizeof(header))
+	{
+		_error = "Failed to write capture header.";
+		close(telem->capture);
+		telem->capture = -1;
+		return 1;
+	}
+
+	return 0;
+}
+
+// Tees raw bytes, before inversion, with the time they were read
+static void telem_capture_write(telem_t telem, const uint8_t *data, size_t length)
+{
+	struct timespec time;
+	telem_capture_chunk_t chunk;
+	struct iovec iov[2];
+
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	chunk.time = (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+	chunk.length = length;
+
+	iov[0].iov_base = &chunk;
+	iov[0].iov_len = sizeof(chunk);
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = length;
+
+	// A failing card shouldn't take telemetry down with it
+	if(writev(telem->capture, iov, 2) != (ssize_t)(sizeof(chunk) + length))
+	{
+		close(telem->capture);
+		telem->capture = -1;
+	}
+}
+
 void telem_close(telem_t telem)
 {
 	if(telem)
 	{
-		if(telem->port >= 0) close(telem->port);
+		unsigned int i;
+
+		if(telem->capture >= 0) close(telem->capture);
+		for(i = 0; i < telem->port_count; i++)
+			if(telem->ports[i].fd >= 0) close(telem->ports[i].fd);
+
 		free(telem);
 	}
 }
@@ -46,53 +217,177 @@ const char *telem_error(void)
 
 int32_t telem_get_altitude(telem_t telem)
 {
-	int16_t whole = telem->values[0x10];
-	uint16_t frac = telem->values[0x21];
-
-	int32_t altitude = (int32_t)whole * 100;
-	if(whole >= 0) altitude += frac;
-	else altitude -= frac;
-
-	return altitude;
+	return telem_snapshot_get_altitude(&telem->published);
 }
 
 uint16_t telem_get_cell_voltage(telem_t telem)
 {
-	uint16_t raw = telem->values[0x06];
-	return ((raw >> 7) & 0x1fe) | ((raw & 0x0f) << 9);
+	return telem_snapshot_get_cell_voltage(&telem->published);
 }
 
 uint8_t telem_get_cells(telem_t telem)
 {
-	return telem->cells;
+	return telem->published.cells;
+}
+
+uint16_t telem_get_channel(telem_t telem, uint8_t channel)
+{
+	return telem_snapshot_get_channel(&telem->published, channel);
 }
 
 uint16_t telem_get_heading(telem_t telem)
 {
-	return telem->values[0x14] * 100 + telem->values[0x1c];
+	return telem_snapshot_get_heading(&telem->published);
 }
 
 uint16_t telem_get_raw(telem_t telem, uint8_t id)
 {
-	return telem->values[id];
+	return telem->published.values[id];
 }
 
 uint16_t telem_get_vfas_voltage(telem_t telem)
 {
-	if(telem->values[0x39])
+	return telem_snapshot_get_vfas_voltage(&telem->published);
+}
+
+int16_t telem_get_vspeed(telem_t telem)
+{
+	return telem_snapshot_get_vspeed(&telem->published);
+}
+
+void telem_invert(telem_t telem, uint8_t invert)
+{
+	telem->ports[0].invert = invert;
+}
+
+static int telem_port_baud(struct telem_port *port, uint32_t baud)
+{
+	port->baud = baud;
+	port->input_length = 0;
+
+	// Pipes, files and the like are read as they are
+	if(port->fd < 0 || !isatty(port->fd)) return 0;
+
+	if(serial_configure(port->fd, baud, SERIAL_8N1, port->protocol->min_frame))
 	{
-		return telem->values[0x39] * 100;
+		_error = strerror(errno);
+		return 1;
 	}
-	else
+
+	serial_flush(port->fd);
+	return 0;
+}
+
+static int telem_port_protocol(struct telem_port *port, telem_protocol_t protocol)
+{
+	if(protocol >= sizeof(_protocols) / sizeof(_protocols[0]) || !_protocols[protocol])
 	{
-		// TODO: Low-precision VFAS using 0x3a and 0x3b
-		return 0;
+		_error = "Unknown telemetry protocol.";
+		return 1;
 	}
+
+	port->protocol = _protocols[protocol];
+	port->protocol_id = protocol;
+
+	return telem_port_baud(port, port->protocol->baud);
 }
 
-void telem_invert(telem_t telem, uint8_t invert)
+static int telem_port_open(struct telem_port *port, const char *device)
+{
+	port->protocol = &telem_protocol_hub;
+	port->protocol_id = TELEM_PROTOCOL_HUB;
+	port->fd = -1;
+
+	// Without a device the decoder is only fed through telem_feed
+	if(device)
+	{
+		port->fd = open(device, O_NDELAY | O_NOCTTY | O_RDONLY);
+		if(port->fd < 0)
+		{
+			_error = strerror(errno);
+			return 1;
+		}
+	}
+
+	return telem_port_baud(port, port->protocol->baud);
+}
+
+int telem_baud(telem_t telem, uint32_t baud)
+{
+	return telem_port_baud(&telem->ports[0], baud);
+}
+
+int telem_protocol(telem_t telem, telem_protocol_t protocol)
+{
+	return telem_port_protocol(&telem->ports[0], protocol);
+}
+
+int telem_add_port(telem_t telem, const char *device, telem_protocol_t protocol, uint32_t baud)
+{
+	struct telem_port *port;
+
+	if(telem->port_count == TELEM_PORTS)
+	{
+		_error = "Too many telemetry ports.";
+		return -1;
+	}
+
+	port = &telem->ports[telem->port_count];
+	memset(port, 0, sizeof(*port));
+
+	if(telem_port_open(port, device) || telem_port_protocol(port, protocol) || (baud && telem_port_baud(port, baud)))
+	{
+		if(port->fd >= 0) close(port->fd);
+		return -1;
+	}
+
+	return telem->port_count++;
+}
+
+void telem_port_priority(telem_t telem, int port, uint8_t priority)
+{
+	telem->ports[port].priority = priority;
+}
+
+void telem_port_stats(telem_t telem, int port, telem_stats_t *stats)
+{
+	*stats = telem->ports[port].stats;
+}
+
+// Descriptors of the ports with a device, for callers that poll them together
+// with their own before calling telem_update
+unsigned int telem_fds(telem_t telem, int *fds, unsigned int max)
 {
-	telem->invert = invert;
+	unsigned int i, count = 0;
+
+	for(i = 0; i < telem->port_count && count < max; i++)
+	{
+		if(telem->ports[i].fd >= 0 && !telem->ports[i].hangup)
+			fds[count++] = telem->ports[i].fd;
+	}
+
+	return count;
+}
+
+static void telem_port_hangup(struct telem_port *port)
+{
+	if(port->hangup) return;
+
+	port->hangup = 1;
+	port->stats.hangups++;
+}
+
+// A port that poll() reports as hung up (an unplugged USB adapter) would
+// otherwise be ready forever, so it is no longer read or polled
+void telem_hangup(telem_t telem, int fd)
+{
+	unsigned int i;
+
+	for(i = 0; i < telem->port_count; i++)
+	{
+		if(telem->ports[i].fd == fd)
+			telem_port_hangup(&telem->ports[i]);
+	}
 }
 
 telem_t telem_open(const char *device)
@@ -101,12 +396,14 @@ telem_t telem_open(const char *device)
 	if(!result) goto fail;
 	memset(result, 0, sizeof(struct telem));
 
-	result->port = open(device, O_NDELAY | O_NOCTTY | O_RDONLY);
-	if(!result->port)
+	result->capture = -1;
+
+	if(telem_port_open(&result->ports[0], device))
 	{
-		_error = strerror(errno);
+		if(result->ports[0].fd >= 0) close(result->ports[0].fd);
 		goto fail;
 	}
+	result->port_count = 1;
 
 	return result;
 
@@ -115,72 +412,572 @@ fail:
 	return 0;
 }
 
-static uint8_t telem_receive(telem_t telem, uint8_t id, uint16_t value)
+void telem_frame(telem_t telem)
+{
+	telem->source->stats.frames++;
+}
+
+void telem_frame_error(telem_t telem)
+{
+	telem->source->stats.errors++;
+}
+
+static void telem_store(telem_t telem, uint8_t id, uint16_t value)
 {
 	uint8_t result = 0;
 
 	switch(id)
 	{
-		case 0x06:
+		case TELEM_ID_CELL:
 		{
 			uint8_t cell = (value >> 4) & 0x0f;
-			if(cell >= telem->cells)
+			if(cell >= telem->published.cells)
 			{
 				result++;
-				telem->cells = cell + 1;
+				telem->published.cells = cell + 1;
 			}
 
 			break;
 		}
 	}	
 
-	if(telem->values[id] != value)
+	if(telem->published.values[id] != value)
 	{
 		result++;
-		telem->values[id] = value;
+		telem->published.values[id] = value;
+	}
+
+	if(result)
+	{
+		telem_mask_set(&telem->changed, id);
+		if(telem->updates < 0xff) telem->updates++;
 	}
 
 	if(telem->callback)
 		telem->callback(telem->callback_data, id, value);
+}
 
-	return result;
+// A port may replace a value stored by another only if it ranks at least as
+// high, or the other has stopped sending it
+static int telem_accept(telem_t telem, struct telem_port *port, uint8_t id)
+{
+	struct telem_port *owner = &telem->ports[telem->owner[id]];
+
+	if(owner != port && owner->priority > port->priority && telem->time - telem->owner_time[id] < TELEM_SOURCE_TIMEOUT)
+		return 0;
+
+	telem->owner[id] = port - telem->ports;
+	telem->owner_time[id] = telem->time;
+	return 1;
 }
 
-uint8_t telem_update(telem_t telem)
+void telem_receive(telem_t telem, uint8_t id, uint16_t value)
 {
-	ssize_t count;
-	uint8_t updates = 0;
-	uint8_t ch;
+	struct telem_port *port = telem->source;
+	unsigned int i;
 
-	while((count = read(telem->port, &ch, sizeof(ch))) > 0)
+	// Derived values come from the merged store, not from a port
+	if(!port)
 	{
-		ch ^= telem->invert;
-		if(ch == 0x5d)
+		telem_store(telem, id, value);
+		return;
+	}
+
+	if(!telem_accept(telem, port, id)) return;
+
+	for(i = 0; i < TELEM_PAIRS; i++)
+	{
+		uint8_t bit = 1 << i;
+
+		// Sources that never send the second half publish the first directly
+		if(id == _pairs[i].first && (port->paired_mask & bit))
 		{
-			telem->escape = 0x60;
+			port->pending[i] = value;
+			port->pending_mask |= bit;
+			return;
 		}
-		else if(ch == 0x5e)
+
+		if(id == _pairs[i].second)
 		{
-			telem->state = 3;
+			if(port->pending_mask & bit)
+				telem_store(telem, _pairs[i].first, port->pending[i]);
+
+			port->paired_mask |= bit;
+			port->pending_mask &= ~bit;
+			break;
 		}
-		else if(telem->state > 0)
+	}
+
+	telem_store(telem, id, value);
+
+	telem->source = 0;
+	telem_derive(telem, &telem->derive, id, telem->time);
+	telem->source = port;
+}
+
+// Altitudes are split into whole metres and centimetres. The hub sends the
+// centimetres unsigned and takes the sign from the metres, which loses it
+// between -1 and 0 m, so the other protocols store them signed instead.
+#define TELEM_ALTITUDE(whole, frac) ((int32_t)(whole) * 100 + ((whole) >= 0 || (frac) < 0 ? (frac) : -(frac)))
+
+_Static_assert(TELEM_ALTITUDE(-50 / 100, -50 % 100) == -50, "-0.5 m must survive the split");
+_Static_assert(TELEM_ALTITUDE(-150 / 100, -150 % 100) == -150, "-1.5 m must survive the split");
+_Static_assert(TELEM_ALTITUDE(-1, 50) == -150, "hub fractions take the sign of the metres");
+_Static_assert(TELEM_ALTITUDE(1, 50) == 150, "positive altitudes are unchanged");
+
+void telem_receive_altitude(telem_t telem, int32_t centimeters)
+{
+	telem_receive(telem, TELEM_ID_ALT, (uint16_t)(int16_t)(centimeters / 100));
+	telem_receive(telem, TELEM_ID_ALT_FRAC, (uint16_t)(int16_t)(centimeters % 100));
+}
+
+void telem_receive_cell(telem_t telem, uint8_t cell, uint16_t millivolts)
+{
+	// Hub cell frames carry the index and top bits in the low byte, and the
+	// voltage is in 2 mV units
+	uint16_t raw = millivolts / 2;
+	telem_receive(telem, TELEM_ID_CELL, ((cell & 0x0f) << 4) | ((raw >> 8) & 0x0f) | ((raw & 0xff) << 8));
+}
+
+void telem_receive_gps_altitude(telem_t telem, int32_t centimeters)
+{
+	telem_receive(telem, TELEM_ID_GPS_ALT, (uint16_t)(int16_t)(centimeters / 100));
+	telem_receive(telem, TELEM_ID_GPS_ALT_FRAC, (uint16_t)(int16_t)(centimeters % 100));
+}
+
+void telem_receive_heading(telem_t telem, uint16_t centidegrees)
+{
+	telem_receive(telem, TELEM_ID_HEADING, centidegrees / 100);
+	telem_receive(telem, TELEM_ID_HEADING_FRAC, centidegrees % 100);
+}
+
+// Hub coordinates are ddmm.mmmm split into whole and fractional fields
+static void telem_receive_coordinate(telem_t telem, uint8_t id, uint8_t id_frac, int32_t degrees_e7)
+{
+	uint32_t magnitude = degrees_e7 < 0 ? -(uint32_t)degrees_e7 : (uint32_t)degrees_e7;
+	uint32_t minutes = (magnitude % 10000000) * 6 / 100;
+
+	telem_receive(telem, id, (magnitude / 10000000) * 100 + minutes / 10000);
+	telem_receive(telem, id_frac, minutes % 10000);
+}
+
+void telem_receive_latitude(telem_t telem, int32_t degrees_e7)
+{
+	telem_receive_coordinate(telem, TELEM_ID_GPS_LAT, TELEM_ID_GPS_LAT_FRAC, degrees_e7);
+	telem_receive(telem, TELEM_ID_GPS_LAT_NS, degrees_e7 < 0 ? 'S' : 'N');
+}
+
+void telem_receive_longitude(telem_t telem, int32_t degrees_e7)
+{
+	telem_receive_coordinate(telem, TELEM_ID_GPS_LON, TELEM_ID_GPS_LON_FRAC, degrees_e7);
+	telem_receive(telem, TELEM_ID_GPS_LON_EW, degrees_e7 < 0 ? 'W' : 'E');
+}
+
+void telem_receive_speed(telem_t telem, uint32_t milliknots)
+{
+	telem_receive(telem, TELEM_ID_GPS_SPEED, milliknots / 1000);
+	telem_receive(telem, TELEM_ID_GPS_SPEED_FRAC, (milliknots % 1000) / 10);
+}
+
+void telem_receive_vfas(telem_t telem, uint32_t millivolts)
+{
+	telem_receive(telem, TELEM_ID_VFAS, millivolts / 100);
+}
+
+static void telem_decode_invert(uint8_t *data, size_t length, uint8_t invert)
+{
+	uint32_t mask = invert * 0x01010101u;
+	size_t i = 0;
+
+	for(; i + 4 <= length; i += 4)
+	{
+		uint32_t word;
+		memcpy(&word, data + i, 4);
+		word ^= mask;
+		memcpy(data + i, &word, 4);
+	}
+
+	for(; i < length; i++)
+		data[i] ^= invert;
+}
+
+static void telem_publish_begin(telem_t telem)
+{
+	unsigned int sequence = atomic_load_explicit(&telem->sequence, memory_order_relaxed);
+
+	atomic_store_explicit(&telem->sequence, sequence + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+static void telem_publish_end(telem_t telem)
+{
+	unsigned int sequence = atomic_load_explicit(&telem->sequence, memory_order_relaxed);
+
+	telem->published.sequence = (sequence + 1) / 2;
+	atomic_store_explicit(&telem->sequence, sequence + 1, memory_order_release);
+}
+
+unsigned int telem_snapshot(telem_t telem, telem_snapshot_t *snapshot)
+{
+	unsigned int begin, end;
+
+	while(1)
+	{
+		begin = atomic_load_explicit(&telem->sequence, memory_order_acquire);
+		if(begin & 1) continue;
+
+		memcpy(snapshot, &telem->published, sizeof(*snapshot));
+
+		atomic_thread_fence(memory_order_acquire);
+		end = atomic_load_explicit(&telem->sequence, memory_order_relaxed);
+		if(begin == end) break;
+	}
+
+	return snapshot->sequence;
+}
+
+int32_t telem_snapshot_get_altitude(const telem_snapshot_t *snapshot)
+{
+	int16_t whole = snapshot->values[TELEM_ID_ALT];
+	int16_t frac = snapshot->values[TELEM_ID_ALT_FRAC];
+
+	return TELEM_ALTITUDE(whole, frac);
+}
+
+uint16_t telem_snapshot_get_cell_voltage(const telem_snapshot_t *snapshot)
+{
+	uint16_t raw = snapshot->values[TELEM_ID_CELL];
+	return ((raw >> 7) & 0x1fe) | ((raw & 0x0f) << 9);
+}
+
+uint16_t telem_snapshot_get_channel(const telem_snapshot_t *snapshot, uint8_t channel)
+{
+	if(channel >= TELEM_CHANNELS) return 0;
+	return snapshot->values[TELEM_ID_CHANNEL + channel];
+}
+
+uint16_t telem_snapshot_get_heading(const telem_snapshot_t *snapshot)
+{
+	return snapshot->values[TELEM_ID_HEADING] * 100 + snapshot->values[TELEM_ID_HEADING_FRAC];
+}
+
+uint16_t telem_snapshot_get_vfas_voltage(const telem_snapshot_t *snapshot)
+{
+	if(snapshot->values[TELEM_ID_VFAS])
+	{
+		return snapshot->values[TELEM_ID_VFAS] * 100;
+	}
+	else
+	{
+		// TODO: Low-precision VFAS using 0x3a and 0x3b
+		return 0;
+	}
+}
+
+int16_t telem_snapshot_get_vspeed(const telem_snapshot_t *snapshot)
+{
+	return snapshot->values[TELEM_ID_VSPEED];
+}
+
+int telem_subscribe(telem_t telem, const telem_mask_t *ids, telem_batch_callback_t callback, void *data)
+{
+	int i;
+
+	for(i = 0; i < TELEM_SUBSCRIBERS; i++)
+	{
+		if(!telem->subscribers[i].callback)
 		{
-			ch ^= telem->escape;
-			telem->escape = 0;
+			telem->subscribers[i].callback = callback;
+			telem->subscribers[i].data = data;
+			telem->subscribers[i].ids = *ids;
+			return 0;
+		}
+	}
 
-			telem->buffer[3 - telem->state] = ch;
-			telem->state--;
+	_error = "Too many telemetry subscribers.";
+	return 1;
+}
 
-			if(telem->state == 0)
-			{
-				uint8_t id = telem->buffer[0];
-				uint16_t value = ((uint16_t)telem->buffer[1] << 0) | ((uint16_t)telem->buffer[2] << 8);
+void telem_unsubscribe(telem_t telem, telem_batch_callback_t callback, void *data)
+{
+	int i;
 
-				if(telem_receive(telem, id, value) && updates < 0xff)
-					updates++;
-			}
+	for(i = 0; i < TELEM_SUBSCRIBERS; i++)
+	{
+		if(telem->subscribers[i].callback == callback && telem->subscribers[i].data == data)
+			telem->subscribers[i].callback = 0;
+	}
+}
+
+// Hands each subscriber the changed IDs it asked for, once per update
+static void telem_notify(telem_t telem)
+{
+	int i, j;
+
+	for(i = 0; i < TELEM_SUBSCRIBERS; i++)
+	{
+		telem_mask_t changed;
+		uint32_t any = 0;
+
+		if(!telem->subscribers[i].callback) continue;
+
+		for(j = 0; j < 8; j++)
+		{
+			changed.bits[j] = telem->changed.bits[j] & telem->subscribers[i].ids.bits[j];
+			any |= changed.bits[j];
 		}
+
+		if(any)
+			telem->subscribers[i].callback(telem->subscribers[i].data, telem, &changed);
 	}
+}
+
+void telem_stats(telem_t telem, telem_stats_t *stats)
+{
+	unsigned int i;
+
+	memset(stats, 0, sizeof(*stats));
+	for(i = 0; i < telem->port_count; i++)
+	{
+		stats->bytes += telem->ports[i].stats.bytes;
+		stats->frames += telem->ports[i].stats.frames;
+		stats->errors += telem->ports[i].stats.errors;
+		stats->reads += telem->ports[i].stats.reads;
+		stats->hangups += telem->ports[i].stats.hangups;
+	}
+}
+
+static void telem_update_begin(telem_t telem)
+{
+	telem->updates = 0;
+	memset(&telem->changed, 0, sizeof(telem->changed));
+}
+
+static uint64_t telem_now(void)
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+// Decodes count new bytes that have been placed after the port's pending input
+static void telem_input(telem_t telem, struct telem_port *port, size_t count)
+{
+	size_t used;
+
+	port->stats.bytes += count;
+	telem->time = telem_now();
+
+	if(telem->capture >= 0 && port == &telem->ports[0])
+		telem_capture_write(telem, port->input + port->input_length, count);
+
+	if(port->invert)
+		telem_decode_invert(port->input + port->input_length, count, port->invert);
+
+	port->input_length += count;
+
+	telem->source = port;
+	used = port->protocol->decode(telem, port->input, port->input_length);
+
+	// Keep the partial frame at the front for the next read; a full buffer
+	// that made no progress can never complete, so drop it
+	if(!used && port->input_length == sizeof(port->input))
+		used = port->input_length;
+
+	port->input_length -= used;
+	memmove(port->input, port->input + used, port->input_length);
+}
+
+static uint8_t telem_update_end(telem_t telem, int published)
+{
+	if(published)
+		telem_publish_end(telem);
+
+	if(telem->updates)
+		telem_notify(telem);
+
+	return telem->updates;
+}
+
+uint8_t telem_feed(telem_t telem, const uint8_t *data, size_t length)
+{
+	telem_update_begin(telem);
+	if(!length) return telem_update_end(telem, 0);
+
+	telem_publish_begin(telem);
+	while(length)
+	{
+		struct telem_port *port = &telem->ports[0];
+		size_t count = sizeof(port->input) - port->input_length;
+		if(count > length) count = length;
+
+		memcpy(port->input + port->input_length, data, count);
+		telem_input(telem, port, count);
+
+		data += count;
+		length -= count;
+	}
+
+	return telem_update_end(telem, 1);
+}
+
+// Drains a port a buffer at a time; a short read means the port is empty
+static void telem_read(telem_t telem, struct telem_port *port, int *publishing)
+{
+	ssize_t count;
+
+	while(1)
+	{
+		size_t space = sizeof(port->input) - port->input_length;
+
+		count = read(port->fd, port->input + port->input_length, space);
+		port->stats.reads++;
+		if(count <= 0) break;
+
+		if(!*publishing)
+		{
+			telem_publish_begin(telem);
+			*publishing = 1;
+		}
+
+		telem_input(telem, port, count);
+		if((size_t)count < space) break;
+	}
+}
+
+uint8_t telem_wait(telem_t telem, int timeout)
+{
+	struct pollfd fds[TELEM_PORTS];
+	unsigned int i;
+	int publishing = 0;
+
+	telem_update_begin(telem);
+
+	// Hung up ports stay in the set with a negative descriptor, which poll()
+	// ignores
+	for(i = 0; i < telem->port_count; i++)
+	{
+		fds[i].fd = telem->ports[i].hangup ? -1 : telem->ports[i].fd;
+		fds[i].events = POLLIN;
+		fds[i].revents = telem->ports[i].hangup ? 0 : POLLIN;
+	}
+
+	// A lone port is just read, so the usual case costs a single read() per
+	// call; several are polled together so only the ready ones are read
+	if(timeout || telem->port_count > 1)
+	{
+		if(poll(fds, telem->port_count, timeout) <= 0)
+			return telem_update_end(telem, 0);
+	}
+
+	for(i = 0; i < telem->port_count; i++)
+	{
+		if(fds[i].revents & POLLIN)
+			telem_read(telem, &telem->ports[i], &publishing);
+
+		// Whatever was still buffered has been read above
+		if(fds[i].revents & (POLLHUP | POLLERR | POLLNVAL))
+			telem_port_hangup(&telem->ports[i]);
+	}
+
+	return telem_update_end(telem, publishing);
+}
+
+uint8_t telem_update(telem_t telem)
+{
+	return telem_wait(telem, 0);
+}
+
+static void telem_reset(telem_t telem)
+{
+	unsigned int i;
+
+	telem_publish_begin(telem);
+	memset(telem->published.values, 0, sizeof(telem->published.values));
+	telem->published.cells = 0;
+	for(i = 0; i < telem->port_count; i++)
+	{
+		telem->ports[i].pending_mask = 0;
+		telem->ports[i].paired_mask = 0;
+	}
+	memset(telem->owner, 0, sizeof(telem->owner));
+	memset(telem->owner_time, 0, sizeof(telem->owner_time));
+	telem_derive_reset(&telem->derive);
+	telem_publish_end(telem);
+}
+
+// Listens with the current configuration for one detection window
+static int telem_detect_try(telem_t telem)
+{
+	struct telem_port *port = &telem->ports[0];
+	struct pollfd fd = {
+		.fd = port->fd,
+		.events = POLLIN,
+	};
+
+	uint64_t end = telem_now() + TELEM_DETECT_WINDOW * 1000;
+	uint32_t frames = port->stats.frames;
+	uint32_t errors = port->stats.errors;
+	uint64_t now;
+
+	port->input_length = 0;
+	telem_reset(telem);
+
+	while((now = telem_now()) < end)
+	{
+		uint32_t good, bad;
+
+		poll(&fd, 1, (end - now + 999) / 1000);
+		telem_update(telem);
+
+		good = port->stats.frames - frames;
+		bad = port->stats.errors - errors;
+		if(good >= TELEM_DETECT_FRAMES && good > 2 * bad)
+			return 1;
+	}
+
+	return 0;
+}
+
+int telem_detect(telem_t telem, unsigned int timeout)
+{
+	uint64_t end = telem_now() + timeout * 1000ull;
+	unsigned int candidate = 0;
+	struct telem_port *port = &telem->ports[0];
+	uint8_t invert = port->invert;
+	telem_protocol_t protocol = port->protocol_id;
+	uint32_t baud = port->baud;
+	const char *error = "No telemetry detected.";
+
+	// The current configuration gets the first try
+	while(telem_now() < end)
+	{
+		port->invert = invert;
+		if(telem_detect_try(telem)) return 0;
+
+		port->invert = ~invert;
+		if(telem_detect_try(telem)) return 0;
+
+		// The configuration just tried may be a candidate too; don't wait out
+		// another window on it
+		if(_candidates[candidate].protocol == port->protocol_id && _candidates[candidate].baud == port->baud)
+			candidate = (candidate + 1) % TELEM_CANDIDATES;
+
+		if(telem_port_protocol(port, _candidates[candidate].protocol) || telem_port_baud(port, _candidates[candidate].baud))
+		{
+			error = _error;
+			break;
+		}
+		candidate = (candidate + 1) % TELEM_CANDIDATES;
+	}
+
+	// Nothing was found, so go back to the configured settings; the last
+	// candidate set up was never listened to
+	port->invert = invert;
+	if(telem_port_protocol(port, protocol) || telem_port_baud(port, baud))
+		error = _error;
+	telem_reset(telem);
 
-	return updates;
+	_error = error;
+	return 1;
 }
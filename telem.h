@@ -1,21 +1,156 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
+#define TELEM_ID_GPS_ALT 0x01
+#define TELEM_ID_TEMP1 0x02
+#define TELEM_ID_RPM 0x03
+#define TELEM_ID_FUEL 0x04
+#define TELEM_ID_TEMP2 0x05
+#define TELEM_ID_CELL 0x06
+#define TELEM_ID_GPS_ALT_FRAC 0x09
+#define TELEM_ID_ALT 0x10
+#define TELEM_ID_GPS_SPEED 0x11
+#define TELEM_ID_GPS_LON 0x12
+#define TELEM_ID_GPS_LAT 0x13
+#define TELEM_ID_HEADING 0x14
+#define TELEM_ID_GPS_SPEED_FRAC 0x19
+#define TELEM_ID_GPS_LON_FRAC 0x1a
+#define TELEM_ID_GPS_LAT_FRAC 0x1b
+#define TELEM_ID_HEADING_FRAC 0x1c
+#define TELEM_ID_ALT_FRAC 0x21
+#define TELEM_ID_GPS_LON_EW 0x22
+#define TELEM_ID_GPS_LAT_NS 0x23
+#define TELEM_ID_CURRENT 0x28
+#define TELEM_ID_VARIO 0x30
+#define TELEM_ID_VFAS 0x39
+
+// Values with no hub equivalent, in IDs the hub protocol leaves unused
+#define TELEM_ID_ROLL 0x40
+#define TELEM_ID_PITCH 0x41
+#define TELEM_ID_GPS_FIX 0x42
+#define TELEM_ID_GPS_SATS 0x43
+#define TELEM_ID_RSSI 0x44
+#define TELEM_ID_LINK_QUALITY 0x45
+#define TELEM_ID_SNR 0x46
+#define TELEM_ID_CAPACITY 0x47
+
+// Computed from the values above as they arrive
+#define TELEM_ID_VSPEED 0x48
+#define TELEM_ID_CONSUMED 0x49
+#define TELEM_ID_CELL_MIN 0x4a
+#define TELEM_ID_HOME_DISTANCE 0x4b
+#define TELEM_ID_HOME_BEARING 0x4c
+#define TELEM_ID_HOME_SET 0x4d
+#define TELEM_ID_CHANNEL 0x80
+
+#define TELEM_CAPTURE_MAGIC 0x434d4c54
+#define TELEM_CAPTURE_VERSION 1
+
+#define TELEM_CHANNELS 16
+#define TELEM_PORTS 4
+#define TELEM_SUBSCRIBERS 8
+
+typedef enum
+{
+	TELEM_PROTOCOL_HUB,
+	TELEM_PROTOCOL_SPORT,
+	TELEM_PROTOCOL_MAVLINK,
+	TELEM_PROTOCOL_CRSF,
+} telem_protocol_t;
+
+// Capture files hold this header, then a chunk header before each block of
+// raw bytes as it was read from the port
+typedef struct
+{
+	uint32_t magic;
+	uint8_t version;
+	uint8_t protocol;
+	uint8_t invert;
+	uint8_t reserved;
+} telem_capture_header_t;
+
+typedef struct __attribute__((packed))
+{
+	uint64_t time;
+	uint32_t length;
+} telem_capture_chunk_t;
+
+typedef struct
+{
+	uint64_t bytes;
+	uint32_t frames;
+	uint32_t errors;
+	uint32_t reads;
+	uint32_t hangups;
+} telem_stats_t;
+
 typedef void (*telem_callback_t)(void *, uint8_t, uint16_t);
 typedef struct telem *telem_t;
 
+typedef struct
+{
+	uint32_t bits[8];
+} telem_mask_t;
+
+typedef void (*telem_batch_callback_t)(void *, telem_t, const telem_mask_t *);
+
+typedef struct
+{
+	unsigned int sequence;
+	uint16_t values[256];
+	uint8_t cells;
+} telem_snapshot_t;
+
 telem_t telem_open(const char *device);
 void telem_close(telem_t telem);
 const char *telem_error(void);
 
+int telem_add_port(telem_t telem, const char *device, telem_protocol_t protocol, uint32_t baud);
+void telem_port_priority(telem_t telem, int port, uint8_t priority);
+void telem_port_stats(telem_t telem, int port, telem_stats_t *stats);
+unsigned int telem_fds(telem_t telem, int *fds, unsigned int max);
+void telem_hangup(telem_t telem, int fd);
+
 void telem_callback(telem_t telem, telem_callback_t callback, void *data);
+int telem_capture(telem_t telem, const char *path);
+const telem_mask_t *telem_changed(telem_t telem);
 uint16_t telem_get_raw(telem_t telem, uint8_t id);
+int telem_baud(telem_t telem, uint32_t baud);
+int telem_detect(telem_t telem, unsigned int timeout);
+uint8_t telem_feed(telem_t telem, const uint8_t *data, size_t length);
 void telem_invert(telem_t telem, uint8_t invert);
+int telem_protocol(telem_t telem, telem_protocol_t protocol);
+int telem_subscribe(telem_t telem, const telem_mask_t *ids, telem_batch_callback_t callback, void *data);
+void telem_unsubscribe(telem_t telem, telem_batch_callback_t callback, void *data);
+void telem_stats(telem_t telem, telem_stats_t *stats);
 uint8_t telem_update(telem_t telem);
+uint8_t telem_wait(telem_t telem, int timeout);
 
 int32_t telem_get_altitude(telem_t telem);
 uint16_t telem_get_cell_voltage(telem_t telem);
+uint16_t telem_get_channel(telem_t telem, uint8_t channel);
 uint8_t telem_get_cells(telem_t telem);
 uint16_t telem_get_heading(telem_t telem);
 uint16_t telem_get_vfas_voltage(telem_t telem);
+int16_t telem_get_vspeed(telem_t telem);
+
+unsigned int telem_snapshot(telem_t telem, telem_snapshot_t *snapshot);
+
+int32_t telem_snapshot_get_altitude(const telem_snapshot_t *snapshot);
+uint16_t telem_snapshot_get_cell_voltage(const telem_snapshot_t *snapshot);
+uint16_t telem_snapshot_get_channel(const telem_snapshot_t *snapshot, uint8_t channel);
+uint16_t telem_snapshot_get_heading(const telem_snapshot_t *snapshot);
+uint16_t telem_snapshot_get_vfas_voltage(const telem_snapshot_t *snapshot);
+int16_t telem_snapshot_get_vspeed(const telem_snapshot_t *snapshot);
+
+static inline void telem_mask_set(telem_mask_t *mask, uint8_t id)
+{
+	mask->bits[id >> 5] |= 1u << (id & 31);
+}
+
+static inline int telem_mask_test(const telem_mask_t *mask, uint8_t id)
+{
+	return (mask->bits[id >> 5] >> (id & 31)) & 1;
+}
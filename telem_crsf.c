@@ -0,0 +1,215 @@
+#include "telem_protocol.h"
+
+#include <string.h>
+
+#define CRSF_ADDRESS_FC 0xc8
+#define CRSF_ADDRESS_RADIO 0xea
+#define CRSF_ADDRESS_RECEIVER 0xec
+#define CRSF_ADDRESS_TX 0xee
+
+#define CRSF_LENGTH_MAX 62
+#define CRSF_LENGTH_MIN 2
+
+#define CRSF_GPS 0x02
+#define CRSF_VARIO 0x07
+#define CRSF_BATTERY 0x08
+#define CRSF_LINK_STATISTICS 0x14
+#define CRSF_RC_CHANNELS 0x16
+#define CRSF_ATTITUDE 0x1e
+
+#define CRSF_CHANNELS 16
+
+static const uint8_t crsf_sync[256] = {
+	[CRSF_ADDRESS_FC] = 1,
+	[CRSF_ADDRESS_RADIO] = 1,
+	[CRSF_ADDRESS_RECEIVER] = 1,
+	[CRSF_ADDRESS_TX] = 1,
+};
+
+// CRC-8/DVB-S2, polynomial 0xd5
+static const uint8_t crsf_crc_table[256] = {
+	0x00, 0xd5, 0x7f, 0xaa, 0xfe, 0x2b, 0x81, 0x54,
+	0x29, 0xfc, 0x56, 0x83, 0xd7, 0x02, 0xa8, 0x7d,
+	0x52, 0x87, 0x2d, 0xf8, 0xac, 0x79, 0xd3, 0x06,
+	0x7b, 0xae, 0x04, 0xd1, 0x85, 0x50, 0xfa, 0x2f,
+	0xa4, 0x71, 0xdb, 0x0e, 0x5a, 0x8f, 0x25, 0xf0,
+	0x8d, 0x58, 0xf2, 0x27, 0x73, 0xa6, 0x0c, 0xd9,
+	0xf6, 0x23, 0x89, 0x5c, 0x08, 0xdd, 0x77, 0xa2,
+	0xdf, 0x0a, 0xa0, 0x75, 0x21, 0xf4, 0x5e, 0x8b,
+	0x9d, 0x48, 0xe2, 0x37, 0x63, 0xb6, 0x1c, 0xc9,
+	0xb4, 0x61, 0xcb, 0x1e, 0x4a, 0x9f, 0x35, 0xe0,
+	0xcf, 0x1a, 0xb0, 0x65, 0x31, 0xe4, 0x4e, 0x9b,
+	0xe6, 0x33, 0x99, 0x4c, 0x18, 0xcd, 0x67, 0xb2,
+	0x39, 0xec, 0x46, 0x93, 0xc7, 0x12, 0xb8, 0x6d,
+	0x10, 0xc5, 0x6f, 0xba, 0xee, 0x3b, 0x91, 0x44,
+	0x6b, 0xbe, 0x14, 0xc1, 0x95, 0x40, 0xea, 0x3f,
+	0x42, 0x97, 0x3d, 0xe8, 0xbc, 0x69, 0xc3, 0x16,
+	0xef, 0x3a, 0x90, 0x45, 0x11, 0xc4, 0x6e, 0xbb,
+	0xc6, 0x13, 0xb9, 0x6c, 0x38, 0xed, 0x47, 0x92,
+	0xbd, 0x68, 0xc2, 0x17, 0x43, 0x96, 0x3c, 0xe9,
+	0x94, 0x41, 0xeb, 0x3e, 0x6a, 0xbf, 0x15, 0xc0,
+	0x4b, 0x9e, 0x34, 0xe1, 0xb5, 0x60, 0xca, 0x1f,
+	0x62, 0xb7, 0x1d, 0xc8, 0x9c, 0x49, 0xe3, 0x36,
+	0x19, 0xcc, 0x66, 0xb3, 0xe7, 0x32, 0x98, 0x4d,
+	0x30, 0xe5, 0x4f, 0x9a, 0xce, 0x1b, 0xb1, 0x64,
+	0x72, 0xa7, 0x0d, 0xd8, 0x8c, 0x59, 0xf3, 0x26,
+	0x5b, 0x8e, 0x24, 0xf1, 0xa5, 0x70, 0xda, 0x0f,
+	0x20, 0xf5, 0x5f, 0x8a, 0xde, 0x0b, 0xa1, 0x74,
+	0x09, 0xdc, 0x76, 0xa3, 0xf7, 0x22, 0x88, 0x5d,
+	0xd6, 0x03, 0xa9, 0x7c, 0x28, 0xfd, 0x57, 0x82,
+	0xff, 0x2a, 0x80, 0x55, 0x01, 0xd4, 0x7e, 0xab,
+	0x84, 0x51, 0xfb, 0x2e, 0x7a, 0xaf, 0x05, 0xd0,
+	0xad, 0x78, 0xd2, 0x07, 0x53, 0x86, 0x2c, 0xf9,
+};
+
+static uint8_t crsf_crc(const uint8_t *data, size_t length)
+{
+	uint8_t crc = 0;
+
+	while(length--)
+		crc = crsf_crc_table[crc ^ *data++];
+
+	return crc;
+}
+
+static uint16_t crsf_u16(const uint8_t *data)
+{
+	return ((uint16_t)data[0] << 8) | data[1];
+}
+
+static uint32_t crsf_u32(const uint8_t *data)
+{
+	return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+// Attitude is sent in 1/10000 radians; stored in tenths of a degree, rounded
+#define CRSF_RAD_TO_DECIDEG(x) (((int32_t)(x) * 1800 + ((x) < 0 ? -15708 : 15708)) / 31416)
+
+_Static_assert(CRSF_RAD_TO_DECIDEG(10000) == 573, "1 rad must decode to 57.3 degrees");
+_Static_assert(CRSF_RAD_TO_DECIDEG(-5000) == -286, "-0.5 rad must decode to -28.6 degrees");
+
+static uint16_t crsf_attitude(const uint8_t *data)
+{
+	return (int16_t)CRSF_RAD_TO_DECIDEG((int16_t)crsf_u16(data));
+}
+
+static void crsf_receive(telem_t telem, uint8_t type, const uint8_t *payload, uint8_t length)
+{
+	switch(type)
+	{
+		case CRSF_GPS:
+			if(length < 15) break;
+
+			// Speed is in 0.1 km/h and altitude in metres offset by 1000
+			telem_receive_latitude(telem, crsf_u32(payload + 0));
+			telem_receive_longitude(telem, crsf_u32(payload + 4));
+			telem_receive_speed(telem, (uint32_t)crsf_u16(payload + 8) * 53996 / 1000);
+			telem_receive_heading(telem, crsf_u16(payload + 10));
+			telem_receive_gps_altitude(telem, ((int32_t)crsf_u16(payload + 12) - 1000) * 100);
+			telem_receive(telem, TELEM_ID_GPS_SATS, payload[14]);
+			break;
+
+		case CRSF_VARIO:
+			if(length < 2) break;
+
+			telem_receive(telem, TELEM_ID_VARIO, crsf_u16(payload));
+			break;
+
+		case CRSF_BATTERY:
+			if(length < 8) break;
+
+			// Voltage and current are in tenths, capacity is a 24-bit mAh count
+			telem_receive_vfas(telem, (uint32_t)crsf_u16(payload + 0) * 100);
+			telem_receive(telem, TELEM_ID_CURRENT, crsf_u16(payload + 2));
+			telem_receive(telem, TELEM_ID_CAPACITY, crsf_u32(payload + 3) & 0xffffff);
+			telem_receive(telem, TELEM_ID_FUEL, payload[7]);
+			break;
+
+		case CRSF_LINK_STATISTICS:
+			if(length < 4) break;
+
+			// Uplink RSSI of the active antenna, in -dBm
+			telem_receive(telem, TELEM_ID_RSSI, length > 4 && payload[4] ? payload[1] : payload[0]);
+			telem_receive(telem, TELEM_ID_LINK_QUALITY, payload[2]);
+			telem_receive(telem, TELEM_ID_SNR, (int8_t)payload[3]);
+			break;
+
+		case CRSF_RC_CHANNELS:
+		{
+			uint32_t bits = 0;
+			uint8_t available = 0;
+			int channel, i = 0;
+
+			if(length < 22) break;
+
+			// 16 little-endian 11-bit values; 172..1811 maps to 988..2012 us
+			for(channel = 0; channel < CRSF_CHANNELS; channel++)
+			{
+				while(available < 11)
+				{
+					bits |= (uint32_t)payload[i++] << available;
+					available += 8;
+				}
+
+				telem_receive(telem, TELEM_ID_CHANNEL + channel, 1500 + (((int32_t)(bits & 0x7ff) - 992) * 5) / 8);
+				bits >>= 11;
+				available -= 11;
+			}
+
+			break;
+		}
+
+		case CRSF_ATTITUDE:
+			if(length < 6) break;
+
+			telem_receive(telem, TELEM_ID_PITCH, crsf_attitude(payload + 0));
+			telem_receive(telem, TELEM_ID_ROLL, crsf_attitude(payload + 2));
+			break;
+	}
+}
+
+static size_t crsf_decode(telem_t telem, const uint8_t *data, size_t length)
+{
+	const uint8_t *end = data + length;
+	const uint8_t *p = data;
+
+	while(p < end)
+	{
+		const uint8_t *start;
+		uint8_t frame_length;
+
+		while(p < end && !crsf_sync[*p]) p++;
+		if(p >= end) return length;
+
+		start = p;
+		if(end - start < 2) return start - data;
+
+		// The length covers the type, payload and CRC
+		frame_length = start[1];
+		p = start + 1;
+		if(frame_length < CRSF_LENGTH_MIN || frame_length > CRSF_LENGTH_MAX)
+			continue;
+
+		if(end - start < 2 + frame_length) return start - data;
+
+		if(crsf_crc(start + 2, frame_length - 1) != start[1 + frame_length])
+		{
+			telem_frame_error(telem);
+			continue;
+		}
+
+		telem_frame(telem);
+
+		crsf_receive(telem, start[2], start + 3, frame_length - 2);
+		p = start + 2 + frame_length;
+	}
+
+	return length;
+}
+
+const struct telem_protocol telem_protocol_crsf = {
+	.name = "crsf",
+	.decode = crsf_decode,
+	.baud = 420000,
+	.min_frame = 2 + CRSF_LENGTH_MIN,
+};
@@ -0,0 +1,245 @@
+#include "telem_protocol.h"
+
+#include <stdint.h>
+#include <string.h>
+
+// Vertical speed filter: each sample moves the estimate 1/2^n of the way
+#define DERIVE_VSPEED_SHIFT 2
+
+// Altitude samples closer together than this are merged, and a gap longer
+// than the limit restarts the estimate (microseconds)
+#define DERIVE_VSPEED_MIN_DT 20000
+#define DERIVE_VSPEED_MAX_DT 1000000
+
+// A current reading is assumed to hold for at most this long (microseconds)
+#define DERIVE_CURRENT_MAX_DT 1000000
+
+// Home is taken from the first position with at least this many satellites,
+// for sources that report them
+#define DERIVE_HOME_SATS 6
+
+// Hub coordinates in units of 1/10000 minute
+#define DERIVE_MINUTES_PER_DEGREE 600000
+
+// cos() of each whole degree, Q15
+static const uint16_t _cos[] = {
+	32767, 32762, 32747, 32722, 32687, 32642, 32587, 32523, 32448, 32364, 32269,
+	32165, 32051, 31927, 31794, 31650, 31498, 31335, 31163, 30982, 30791, 30591,
+	30381, 30162, 29934, 29697, 29451, 29196, 28932, 28659, 28377, 28087, 27788,
+	27481, 27165, 26841, 26509, 26169, 25821, 25465, 25101, 24730, 24351, 23964,
+	23571, 23170, 22762, 22347, 21925, 21497, 21062, 20621, 20173, 19720, 19260,
+	18794, 18323, 17846, 17364, 16876, 16384, 15886, 15383, 14876, 14364, 13848,
+	13328, 12803, 12275, 11743, 11207, 10668, 10126, 9580, 9032, 8481, 7927, 7371,
+	6813, 6252, 5690, 5126, 4560, 3993, 3425, 2856, 2286, 1715, 1144, 572, 0,
+};
+
+// atan(i / 32) in centidegrees
+static const uint16_t _atan[] = {
+	0, 179, 358, 536, 713, 888, 1062, 1234, 1404, 1571, 1735, 1897, 2056, 2211,
+	2363, 2511, 2657, 2798, 2936, 3070, 3201, 3327, 3451, 3571, 3687, 3800, 3909,
+	4016, 4119, 4218, 4315, 4409, 4500,
+};
+
+static uint32_t derive_sqrt(uint64_t value)
+{
+	uint64_t result = 0, bit = 1ull << 62;
+
+	while(bit > value)
+		bit >>= 2;
+
+	while(bit)
+	{
+		if(value >= result + bit)
+		{
+			value -= result + bit;
+			result = (result >> 1) + bit;
+		}
+		else
+		{
+			result >>= 1;
+		}
+
+		bit >>= 2;
+	}
+
+	return result;
+}
+
+static uint32_t derive_cos(uint32_t minutes)
+{
+	uint32_t degree = minutes / DERIVE_MINUTES_PER_DEGREE;
+	uint32_t frac = minutes % DERIVE_MINUTES_PER_DEGREE;
+
+	if(degree >= 90) return 0;
+	return _cos[degree] - (uint64_t)(_cos[degree] - _cos[degree + 1]) * frac / DERIVE_MINUTES_PER_DEGREE;
+}
+
+// Degrees clockwise from north of the vector
+static uint16_t derive_bearing(int64_t east, int64_t north)
+{
+	uint64_t x = north < 0 ? -north : north;
+	uint64_t y = east < 0 ? -east : east;
+	uint64_t small = x < y ? x : y, large = x < y ? y : x;
+	uint32_t angle, index, frac;
+
+	if(!large) return 0;
+
+	// atan of the smaller over the larger side, interpolated in Q5.8
+	index = (small << 13) / large;
+	frac = index & 0xff;
+	index >>= 8;
+	angle = _atan[index];
+	if(index < 32) angle += ((_atan[index + 1] - _atan[index]) * frac) >> 8;
+
+	if(y > x) angle = 9000 - angle;
+
+	if(north < 0) angle = 18000 - angle;
+	if(east < 0) angle = 36000 - angle;
+
+	return ((angle + 50) / 100) % 360;
+}
+
+// Hub ddmm.mmmm fields as signed 1/10000 minutes
+static int32_t derive_coordinate(telem_t telem, uint8_t id, uint8_t id_frac, uint8_t id_sign, char negative)
+{
+	uint16_t whole = telem_get_raw(telem, id);
+	int32_t minutes = (whole / 100) * DERIVE_MINUTES_PER_DEGREE + (whole % 100) * 10000 + telem_get_raw(telem, id_frac);
+
+	return telem_get_raw(telem, id_sign) == negative ? -minutes : minutes;
+}
+
+static void derive_vspeed(telem_t telem, struct telem_derive *derive, uint64_t time)
+{
+	int32_t altitude = telem_get_altitude(telem);
+	uint64_t dt = time - derive->altitude_time;
+	int32_t vspeed;
+
+	if(dt < DERIVE_VSPEED_MIN_DT) return;
+
+	if(derive->altitude_time && dt <= DERIVE_VSPEED_MAX_DT)
+	{
+		int64_t rate = ((int64_t)altitude - derive->altitude) * 1000000 / (int64_t)dt;
+
+		// A glitched altitude step can be far outside what the output holds;
+		// clamp it so the filter state can't overflow
+		if(rate > INT16_MAX) rate = INT16_MAX;
+		if(rate < INT16_MIN) rate = INT16_MIN;
+
+		derive->vspeed += ((int32_t)rate * 256 - derive->vspeed) >> DERIVE_VSPEED_SHIFT;
+	}
+
+	derive->altitude = altitude;
+	derive->altitude_time = time;
+
+	vspeed = derive->vspeed >> 8;
+	if(vspeed > INT16_MAX) vspeed = INT16_MAX;
+	if(vspeed < INT16_MIN) vspeed = INT16_MIN;
+
+	telem_receive(telem, TELEM_ID_VSPEED, (uint16_t)(int16_t)vspeed);
+}
+
+static void derive_consumed(telem_t telem, struct telem_derive *derive, uint64_t time)
+{
+	uint64_t dt = time - derive->current_time;
+	uint64_t consumed;
+
+	// Sources that count capacity themselves know better
+	if(derive->capacity_reported) return;
+
+	if(derive->current_time)
+	{
+		if(dt > DERIVE_CURRENT_MAX_DT) dt = DERIVE_CURRENT_MAX_DT;
+		derive->charge += (uint64_t)derive->current * dt;
+	}
+
+	derive->current = telem_get_raw(telem, TELEM_ID_CURRENT);
+	derive->current_time = time;
+
+	// Charge is in 0.1 A microseconds
+	consumed = derive->charge / 36000000;
+	telem_receive(telem, TELEM_ID_CONSUMED, consumed > UINT16_MAX ? UINT16_MAX : consumed);
+}
+
+static void derive_cell_min(telem_t telem, struct telem_derive *derive)
+{
+	uint8_t cell = (telem_get_raw(telem, TELEM_ID_CELL) >> 4) & 0x0f;
+	uint8_t cells = telem_get_cells(telem);
+	uint16_t min = UINT16_MAX;
+	int i;
+
+	derive->cells[cell] = telem_get_cell_voltage(telem);
+
+	for(i = 0; i < cells; i++)
+		if(derive->cells[i] && derive->cells[i] < min) min = derive->cells[i];
+
+	if(min != UINT16_MAX)
+		telem_receive(telem, TELEM_ID_CELL_MIN, min);
+}
+
+static void derive_home(telem_t telem, struct telem_derive *derive)
+{
+	int32_t latitude = derive_coordinate(telem, TELEM_ID_GPS_LAT, TELEM_ID_GPS_LAT_FRAC, TELEM_ID_GPS_LAT_NS, 'S');
+	int32_t longitude = derive_coordinate(telem, TELEM_ID_GPS_LON, TELEM_ID_GPS_LON_FRAC, TELEM_ID_GPS_LON_EW, 'W');
+	uint16_t sats = telem_get_raw(telem, TELEM_ID_GPS_SATS);
+	int64_t north, east;
+	uint32_t distance;
+
+	if(!latitude && !longitude) return;
+
+	if(!derive->home_set)
+	{
+		if(sats && sats < DERIVE_HOME_SATS) return;
+
+		derive->home_latitude = latitude;
+		derive->home_longitude = longitude;
+		derive->home_set = 1;
+
+		telem_receive(telem, TELEM_ID_HOME_SET, 1);
+	}
+
+	// Home from here, in decimetres; a minute of latitude is 1852 m
+	north = (int64_t)(derive->home_latitude - latitude) * 1852 / 1000;
+	east = derive->home_longitude - longitude;
+	if(east > 180 * DERIVE_MINUTES_PER_DEGREE) east -= 360 * DERIVE_MINUTES_PER_DEGREE;
+	if(east < -180 * DERIVE_MINUTES_PER_DEGREE) east += 360 * DERIVE_MINUTES_PER_DEGREE;
+	east = east * 1852 * derive_cos(latitude < 0 ? -latitude : latitude) / (1000 << 15);
+
+	distance = (derive_sqrt(north * north + east * east) + 5) / 10;
+
+	telem_receive(telem, TELEM_ID_HOME_DISTANCE, distance > UINT16_MAX ? UINT16_MAX : distance);
+	telem_receive(telem, TELEM_ID_HOME_BEARING, derive_bearing(east, north));
+}
+
+void telem_derive(telem_t telem, struct telem_derive *derive, uint8_t id, uint64_t time)
+{
+	switch(id)
+	{
+		case TELEM_ID_ALT:
+		case TELEM_ID_ALT_FRAC:
+			derive_vspeed(telem, derive, time);
+			break;
+
+		case TELEM_ID_CURRENT:
+			derive_consumed(telem, derive, time);
+			break;
+
+		case TELEM_ID_CAPACITY:
+			derive->capacity_reported = 1;
+			telem_receive(telem, TELEM_ID_CONSUMED, telem_get_raw(telem, TELEM_ID_CAPACITY));
+			break;
+
+		case TELEM_ID_CELL:
+			derive_cell_min(telem, derive);
+			break;
+
+		// Sources send the longitude last, so the position is complete
+		case TELEM_ID_GPS_LON_EW:
+			derive_home(telem, derive);
+			break;
+	}
+}
+
+void telem_derive_reset(struct telem_derive *derive)
+{
+	memset(derive, 0, sizeof(*derive));
+}
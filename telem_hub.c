@@ -0,0 +1,93 @@
+#include "telem_protocol.h"
+
+#include <string.h>
+
+#define HUB_ESCAPE 0x5d
+#define HUB_START 0x5e
+
+#define HUB_ID_MAX 0x3b
+
+// Bytes that need attention inside a frame body; everything else is data
+static const uint8_t hub_special[256] = {
+	[HUB_ESCAPE] = 1,
+	[HUB_START] = 1,
+};
+
+static size_t hub_decode(telem_t telem, const uint8_t *data, size_t length)
+{
+	const uint8_t *end = data + length;
+	const uint8_t *p = data;
+
+	while(p < end)
+	{
+		const uint8_t *start;
+		uint8_t frame[3];
+		int i;
+
+		start = memchr(p, HUB_START, end - p);
+		if(!start) return length;
+
+		p = start + 1;
+
+		// Fast path: an unescaped frame is just the next three bytes
+		if(end - p >= 3 && !(hub_special[p[0]] | hub_special[p[1]] | hub_special[p[2]]))
+		{
+			frame[0] = p[0];
+			frame[1] = p[1];
+			frame[2] = p[2];
+			p += 3;
+		}
+		else
+		{
+			for(i = 0; i < 3; i++)
+			{
+				if(p >= end) return start - data;
+				if(*p == HUB_START) break;
+
+				if(*p == HUB_ESCAPE)
+				{
+					if(++p >= end) return start - data;
+					if(*p == HUB_START) break;
+					frame[i] = *p++ ^ 0x60;
+				}
+				else
+				{
+					frame[i] = *p++;
+				}
+			}
+
+			// Truncated by a new start byte; resume the scan from it
+			if(i < 3)
+			{
+				telem_frame_error(telem);
+				continue;
+			}
+		}
+
+		// An ID the hub doesn't define is line noise, and would land on the
+		// values the other protocols and the derived ones store above it
+		if(frame[0] > HUB_ID_MAX)
+		{
+			telem_frame_error(telem);
+			continue;
+		}
+
+		// Frames run back to back and a burst ends with a start byte, so any
+		// other byte after a frame counts against the stream
+		if(p < end && *p != HUB_START)
+			telem_frame_error(telem);
+		else
+			telem_frame(telem);
+
+		telem_receive(telem, frame[0], (uint16_t)frame[1] | ((uint16_t)frame[2] << 8));
+	}
+
+	return length;
+}
+
+const struct telem_protocol telem_protocol_hub = {
+	.name = "hub",
+	.decode = hub_decode,
+	.baud = 9600,
+	.min_frame = 4,
+};
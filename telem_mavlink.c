@@ -0,0 +1,188 @@
+#include "telem_protocol.h"
+
+#include <string.h>
+
+#define MAVLINK_V1_MAGIC 0xfe
+#define MAVLINK_V1_HEADER 6
+#define MAVLINK_V2_MAGIC 0xfd
+#define MAVLINK_V2_HEADER 10
+#define MAVLINK_V2_SIGNATURE 13
+#define MAVLINK_V2_SIGNED 0x01
+
+#define MAVLINK_SYS_STATUS 1
+#define MAVLINK_GPS_RAW_INT 24
+#define MAVLINK_ATTITUDE 30
+#define MAVLINK_GLOBAL_POSITION_INT 33
+#define MAVLINK_VFR_HUD 74
+
+// Radians to tenths of a degree
+#define MAVLINK_RAD_TO_DECIDEG 572.957795f
+
+static const uint8_t mavlink_magic[256] = {
+	[MAVLINK_V1_MAGIC] = 1,
+	[MAVLINK_V2_MAGIC] = 1,
+};
+
+static uint16_t mavlink_crc(uint16_t crc, const uint8_t *data, size_t length)
+{
+	while(length--)
+	{
+		uint8_t tmp = *data++ ^ (crc & 0xff);
+		tmp ^= tmp << 4;
+		crc = (crc >> 8) ^ ((uint16_t)tmp << 8) ^ ((uint16_t)tmp << 3) ^ (tmp >> 4);
+	}
+
+	return crc;
+}
+
+static uint8_t mavlink_crc_extra(uint32_t msgid)
+{
+	switch(msgid)
+	{
+		case MAVLINK_SYS_STATUS: return 124;
+		case MAVLINK_GPS_RAW_INT: return 24;
+		case MAVLINK_ATTITUDE: return 39;
+		case MAVLINK_GLOBAL_POSITION_INT: return 104;
+		case MAVLINK_VFR_HUD: return 20;
+	}
+
+	return 0;
+}
+
+// Payload fields are read in place. MAVLink 2 strips trailing zero bytes, so
+// anything past the received length reads as zero.
+static uint32_t mavlink_field(const uint8_t *payload, uint8_t length, uint8_t offset, uint8_t size)
+{
+	uint32_t value = 0;
+	uint8_t i;
+
+	for(i = 0; i < size && offset + i < length; i++)
+		value |= (uint32_t)payload[offset + i] << (8 * i);
+
+	return value;
+}
+
+static float mavlink_float(const uint8_t *payload, uint8_t length, uint8_t offset)
+{
+	uint32_t bits = mavlink_field(payload, length, offset, 4);
+	float value;
+
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+static void mavlink_receive(telem_t telem, uint32_t msgid, const uint8_t *payload, uint8_t length)
+{
+	switch(msgid)
+	{
+		case MAVLINK_SYS_STATUS:
+		{
+			uint16_t voltage = mavlink_field(payload, length, 14, 2);
+			int16_t current = mavlink_field(payload, length, 16, 2);
+			int8_t remaining = mavlink_field(payload, length, 30, 1);
+
+			if(voltage != UINT16_MAX) telem_receive_vfas(telem, voltage);
+			if(current >= 0) telem_receive(telem, TELEM_ID_CURRENT, current / 10);
+			if(remaining >= 0) telem_receive(telem, TELEM_ID_FUEL, remaining);
+			break;
+		}
+
+		case MAVLINK_GPS_RAW_INT:
+			telem_receive_gps_altitude(telem, (int32_t)mavlink_field(payload, length, 16, 4) / 10);
+			telem_receive(telem, TELEM_ID_GPS_FIX, mavlink_field(payload, length, 28, 1));
+			telem_receive(telem, TELEM_ID_GPS_SATS, mavlink_field(payload, length, 29, 1));
+			break;
+
+		case MAVLINK_ATTITUDE:
+			telem_receive(telem, TELEM_ID_ROLL, (int16_t)(mavlink_float(payload, length, 4) * MAVLINK_RAD_TO_DECIDEG));
+			telem_receive(telem, TELEM_ID_PITCH, (int16_t)(mavlink_float(payload, length, 8) * MAVLINK_RAD_TO_DECIDEG));
+			break;
+
+		case MAVLINK_GLOBAL_POSITION_INT:
+		{
+			uint16_t heading = mavlink_field(payload, length, 26, 2);
+
+			telem_receive_latitude(telem, mavlink_field(payload, length, 4, 4));
+			telem_receive_longitude(telem, mavlink_field(payload, length, 8, 4));
+			telem_receive_altitude(telem, (int32_t)mavlink_field(payload, length, 16, 4) / 10);
+			if(heading != UINT16_MAX) telem_receive_heading(telem, heading);
+			break;
+		}
+
+		case MAVLINK_VFR_HUD:
+		{
+			float speed = mavlink_float(payload, length, 4);
+			float climb = mavlink_float(payload, length, 12);
+
+			// Ground speed is in m/s and climb rate feeds the vario in cm/s
+			telem_receive_speed(telem, speed > 0 ? (uint32_t)(speed * 1943.844f) : 0);
+			telem_receive(telem, TELEM_ID_VARIO, (int16_t)(climb * 100.0f));
+			break;
+		}
+	}
+}
+
+static size_t mavlink_decode(telem_t telem, const uint8_t *data, size_t length)
+{
+	const uint8_t *end = data + length;
+	const uint8_t *p = data;
+
+	while(p < end)
+	{
+		const uint8_t *start;
+		size_t header, total;
+		uint32_t msgid;
+		uint16_t crc;
+		uint8_t extra, payload_length;
+
+		while(p < end && !mavlink_magic[*p]) p++;
+		if(p >= end) return length;
+
+		start = p;
+		header = (*start == MAVLINK_V2_MAGIC) ? MAVLINK_V2_HEADER : MAVLINK_V1_HEADER;
+		if((size_t)(end - start) < header) return start - data;
+
+		payload_length = start[1];
+		total = header + payload_length + 2;
+		if(header == MAVLINK_V2_HEADER)
+		{
+			if(start[2] & MAVLINK_V2_SIGNED) total += MAVLINK_V2_SIGNATURE;
+			msgid = (uint32_t)start[7] | ((uint32_t)start[8] << 8) | ((uint32_t)start[9] << 16);
+		}
+		else
+		{
+			msgid = start[5];
+		}
+
+		// Without the CRC seed an unknown message can't be validated, so only
+		// the magic byte is skipped and the scan resumes inside it
+		p = start + 1;
+
+		extra = mavlink_crc_extra(msgid);
+		if(!extra) continue;
+
+		if((size_t)(end - start) < total) return start - data;
+
+		crc = mavlink_crc(0xffff, start + 1, header - 1 + payload_length);
+		crc = mavlink_crc(crc, &extra, 1);
+		if(crc != ((uint16_t)start[header + payload_length] | ((uint16_t)start[header + payload_length + 1] << 8)))
+		{
+			telem_frame_error(telem);
+			continue;
+		}
+
+		telem_frame(telem);
+
+		mavlink_receive(telem, msgid, start + header, payload_length);
+		p = start + total;
+	}
+
+	return length;
+}
+
+const struct telem_protocol telem_protocol_mavlink = {
+	.name = "mavlink",
+	.decode = mavlink_decode,
+	.baud = 57600,
+	.min_frame = MAVLINK_V1_HEADER + 2,
+};
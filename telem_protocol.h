@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "telem.h"
+
+// A protocol decodes every complete frame at the start of the buffer and
+// returns the number of bytes consumed; the remainder is kept and handed
+// back, with more data appended, on the next call.
+struct telem_protocol
+{
+	const char *name;
+	size_t (*decode)(telem_t telem, const uint8_t *data, size_t length);
+
+	// Default link speed, and the shortest frame, used to batch port wakeups
+	uint32_t baud;
+	uint8_t min_frame;
+};
+
+extern const struct telem_protocol telem_protocol_crsf;
+extern const struct telem_protocol telem_protocol_hub;
+extern const struct telem_protocol telem_protocol_mavlink;
+extern const struct telem_protocol telem_protocol_sport;
+
+// Decoders report each complete frame, and each frame rejected by its checksum
+// or cut short, for the port statistics
+void telem_frame(telem_t telem);
+void telem_frame_error(telem_t telem);
+
+// Values from every protocol are stored in the FrSky hub ID space, so these
+// convert native units into the hub fields the getters read.
+void telem_receive(telem_t telem, uint8_t id, uint16_t value);
+void telem_receive_altitude(telem_t telem, int32_t centimeters);
+void telem_receive_cell(telem_t telem, uint8_t cell, uint16_t millivolts);
+void telem_receive_gps_altitude(telem_t telem, int32_t centimeters);
+void telem_receive_heading(telem_t telem, uint16_t centidegrees);
+void telem_receive_latitude(telem_t telem, int32_t degrees_e7);
+void telem_receive_longitude(telem_t telem, int32_t degrees_e7);
+void telem_receive_speed(telem_t telem, uint32_t milliknots);
+void telem_receive_vfas(telem_t telem, uint32_t millivolts);
+
+// Derived values are recomputed by telem_receive when one of their inputs
+// arrives, from fixed-point state kept here
+struct telem_derive
+{
+	uint64_t altitude_time;
+	int32_t altitude;
+	int32_t vspeed;
+
+	uint64_t current_time;
+	uint64_t charge;
+	uint16_t current;
+	uint8_t capacity_reported;
+
+	uint16_t cells[16];
+
+	int32_t home_latitude;
+	int32_t home_longitude;
+	uint8_t home_set;
+};
+
+void telem_derive(telem_t telem, struct telem_derive *derive, uint8_t id, uint64_t time);
+void telem_derive_reset(struct telem_derive *derive);
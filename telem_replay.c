@@ -0,0 +1,543 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "telem.h"
+
+// Raw streams without a capture header are replayed in blocks of this size
+#define RAW_CHUNK 256
+
+// Largest write to the pty master before draining the slave
+#define PTY_CHUNK 512
+#define PTY_TIMEOUT_NS 1000000000ull
+
+typedef struct
+{
+	const uint8_t *data;
+	uint32_t length;
+	uint64_t time;
+} chunk_t;
+
+static const char *protocol_names[] = {
+	[TELEM_PROTOCOL_HUB] = "hub",
+	[TELEM_PROTOCOL_SPORT] = "sport",
+	[TELEM_PROTOCOL_MAVLINK] = "mavlink",
+	[TELEM_PROTOCOL_CRSF] = "crsf",
+};
+
+#define PROTOCOLS (sizeof(protocol_names) / sizeof(protocol_names[0]))
+
+// The hub reader as it was before buffered reads and the frame scanner: one
+// read() per byte and a per-byte state machine, kept as the baseline for -b
+struct baseline
+{
+	int fd;
+	telem_stats_t stats;
+	uint16_t values[256];
+
+	uint8_t buffer[3];
+	uint8_t escape;
+	uint8_t state;
+};
+
+static void baseline_decode(struct baseline *baseline, uint8_t ch)
+{
+	baseline->stats.bytes++;
+
+	if(ch == 0x5d)
+	{
+		baseline->escape = 0x60;
+	}
+	else if(ch == 0x5e)
+	{
+		baseline->state = 3;
+	}
+	else if(baseline->state > 0)
+	{
+		ch ^= baseline->escape;
+		baseline->escape = 0;
+
+		baseline->buffer[3 - baseline->state] = ch;
+		baseline->state--;
+
+		if(baseline->state == 0)
+		{
+			baseline->values[baseline->buffer[0]] = (uint16_t)baseline->buffer[1] | ((uint16_t)baseline->buffer[2] << 8);
+			baseline->stats.frames++;
+		}
+	}
+}
+
+static void baseline_read(struct baseline *baseline)
+{
+	uint8_t ch;
+
+	while(1)
+	{
+		baseline->stats.reads++;
+		if(read(baseline->fd, &ch, sizeof(ch)) <= 0) break;
+
+		baseline_decode(baseline, ch);
+	}
+}
+
+static void replay_stats(telem_t telem, const struct baseline *baseline, telem_stats_t *stats)
+{
+	if(baseline)
+		*stats = baseline->stats;
+	else
+		telem_stats(telem, stats);
+}
+
+static uint64_t replay_cpu_time(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	return (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static uint64_t replay_now(void)
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+static void replay_sleep_until(uint64_t when)
+{
+	struct timespec time = {
+		.tv_sec = when / 1000000000,
+		.tv_nsec = when % 1000000000,
+	};
+
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &time, 0));
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+// Splits a capture (or a raw stream) into chunks; returns the chunk count
+static size_t replay_index(const uint8_t *data, size_t length, int raw, chunk_t *chunks)
+{
+	size_t count = 0, offset = raw ? 0 : sizeof(telem_capture_header_t);
+
+	while(offset < length)
+	{
+		chunk_t chunk;
+
+		if(raw)
+		{
+			chunk.data = data + offset;
+			chunk.length = (length - offset < RAW_CHUNK) ? length - offset : RAW_CHUNK;
+			chunk.time = 0;
+		}
+		else
+		{
+			telem_capture_chunk_t header;
+
+			if(length - offset < sizeof(header)) break;
+			memcpy(&header, data + offset, sizeof(header));
+			offset += sizeof(header);
+
+			if(length - offset < header.length) break;
+			chunk.data = data + offset;
+			chunk.length = header.length;
+			chunk.time = header.time;
+		}
+
+		if(chunks) chunks[count] = chunk;
+		offset += chunk.length;
+		count++;
+	}
+
+	return count;
+}
+
+// Writes a chunk into the pty and decodes until all of it has come through.
+// The reader sleeps in poll() between reads, so the read() count is what a
+// real port would cost rather than a spin.
+static int replay_pty(telem_t telem, struct baseline *baseline, int master, const chunk_t *chunk)
+{
+	uint32_t offset = 0;
+
+	while(offset < chunk->length)
+	{
+		telem_stats_t stats;
+		uint64_t expected, deadline;
+		uint32_t count = chunk->length - offset;
+		if(count > PTY_CHUNK) count = PTY_CHUNK;
+
+		replay_stats(telem, baseline, &stats);
+		expected = stats.bytes + count;
+
+		if(write(master, chunk->data + offset, count) != (ssize_t)count)
+			return 1;
+
+		deadline = replay_now() + PTY_TIMEOUT_NS;
+		while(stats.bytes < expected)
+		{
+			uint64_t now = replay_now();
+			int timeout;
+
+			if(now > deadline) return 1;
+			timeout = (deadline - now + 999999) / 1000000;
+
+			if(baseline)
+			{
+				struct pollfd fd = {
+					.fd = baseline->fd,
+					.events = POLLIN,
+				};
+
+				if(poll(&fd, 1, timeout) > 0)
+					baseline_read(baseline);
+			}
+			else
+			{
+				telem_wait(telem, timeout);
+			}
+
+			replay_stats(telem, baseline, &stats);
+		}
+
+		offset += count;
+	}
+
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-p] [-b] [-r] [-n loops] [-P protocol] [-i] capture\n"
+		"  -p  replay through a pseudo-terminal instead of in memory\n"
+		"  -b  decode the hub stream with the original per-byte state machine as\n"
+		"      a baseline, reading a byte at a time with -p\n"
+		"  -r  replay in real time using the capture timestamps\n"
+		"  -n  replay the capture this many times\n"
+		"  -P  protocol (hub, sport, mavlink, crsf); treats the file as raw\n"
+		"      bytes if it has no capture header\n"
+		"  -i  invert raw input\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	const char *error = 0, *path;
+	int option, loops = 1, pty = 0, raw = 0, realtime = 0;
+	int protocol = -1, invert = 0, use_baseline = 0;
+
+	int fd = -1, master = -1, slave = -1;
+	uint8_t *data = MAP_FAILED;
+	size_t length = 0;
+
+	chunk_t *chunks = 0;
+	uint64_t *latencies = 0;
+	size_t chunk_count, latency_count = 0;
+	telem_t telem = 0;
+	struct baseline baseline = {0}, *reference = 0;
+
+	while((option = getopt(argc, argv, "bin:pP:r")) != -1)
+	{
+		switch(option)
+		{
+			case 'b':
+				use_baseline = 1;
+				break;
+
+			case 'i':
+				invert = 1;
+				break;
+
+			case 'n':
+				loops = atoi(optarg);
+				break;
+
+			case 'p':
+				pty = 1;
+				break;
+
+			case 'P':
+				for(protocol = 0; protocol < (int)PROTOCOLS; protocol++)
+					if(!strcmp(optarg, protocol_names[protocol])) break;
+
+				if(protocol == PROTOCOLS)
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+
+			case 'r':
+				realtime = 1;
+				break;
+
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if(optind != argc - 1 || loops < 1)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	path = argv[optind];
+
+	// Map the capture
+	{
+		struct stat st;
+
+		fd = open(path, O_RDONLY);
+		if(fd < 0 || fstat(fd, &st))
+		{
+			error = "Failed to open capture.";
+			goto cleanup;
+		}
+
+		length = st.st_size;
+		if(length)
+			data = mmap(0, length, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if(data == MAP_FAILED)
+		{
+			error = "Failed to map capture.";
+			goto cleanup;
+		}
+	}
+
+	// Read the header, falling back to a raw stream
+	{
+		telem_capture_header_t header;
+
+		if(length >= sizeof(header))
+			memcpy(&header, data, sizeof(header));
+
+		if(length >= sizeof(header) && header.magic == TELEM_CAPTURE_MAGIC && header.version == TELEM_CAPTURE_VERSION)
+		{
+			if(header.protocol >= PROTOCOLS)
+			{
+				error = "Capture has an unknown protocol.";
+				goto cleanup;
+			}
+
+			if(protocol < 0) protocol = header.protocol;
+			invert = header.invert;
+		}
+		else if(protocol >= 0)
+		{
+			raw = 1;
+			invert = invert ? 0xff : 0;
+
+			if(realtime)
+			{
+				fprintf(stderr, "WARNING: Raw streams have no timestamps; replaying as fast as possible.\n");
+				realtime = 0;
+			}
+		}
+		else
+		{
+			error = "Not a telemetry capture; use -P to replay a raw stream.";
+			goto cleanup;
+		}
+	}
+
+	if(use_baseline && (protocol != TELEM_PROTOCOL_HUB || invert))
+	{
+		error = "The baseline only reads uninverted hub streams.";
+		goto cleanup;
+	}
+
+	chunk_count = replay_index(data, length, raw, 0);
+	chunks = malloc(chunk_count * sizeof(chunk_t) + 1);
+	latencies = malloc(chunk_count * loops * sizeof(uint64_t) + 1);
+	if(!chunks || !latencies)
+	{
+		error = "Failed to allocate chunk index.";
+		goto cleanup;
+	}
+	replay_index(data, length, raw, chunks);
+
+	// Open the decoder, on the slave side of a pty if requested
+	if(pty)
+	{
+		struct termios attributes;
+		char name[64];
+
+		if(openpty(&master, &slave, name, 0, 0))
+		{
+			error = "Failed to open pseudo-terminal.";
+			goto cleanup;
+		}
+
+		tcgetattr(slave, &attributes);
+		cfmakeraw(&attributes);
+		tcsetattr(slave, TCSANOW, &attributes);
+
+		if(use_baseline)
+		{
+			fcntl(slave, F_SETFL, fcntl(slave, F_GETFL) | O_NONBLOCK);
+			baseline.fd = slave;
+		}
+
+		telem = telem_open(name);
+	}
+	else
+	{
+		telem = telem_open(0);
+	}
+
+	if(!telem)
+	{
+		error = telem_error();
+		goto cleanup;
+	}
+
+	if(use_baseline)
+		reference = &baseline;
+
+	if(telem_protocol(telem, protocol))
+	{
+		error = telem_error();
+		goto cleanup;
+	}
+
+	telem_invert(telem, invert);
+
+	// Replay
+	{
+		telem_stats_t stats;
+		uint64_t decode_time = 0, start = replay_now(), cpu_start = replay_cpu_time(), cpu_time;
+		size_t i;
+		int loop;
+
+		for(loop = 0; loop < loops; loop++)
+		{
+			uint64_t loop_start = replay_now();
+
+			for(i = 0; i < chunk_count; i++)
+			{
+				uint64_t begin, end;
+				uint32_t frames;
+
+				if(realtime)
+					replay_sleep_until(loop_start + (chunks[i].time - chunks[0].time));
+
+				replay_stats(telem, reference, &stats);
+				frames = stats.frames;
+
+				begin = replay_now();
+				if(pty)
+				{
+					if(replay_pty(telem, reference, master, &chunks[i]))
+					{
+						error = "Timed out replaying through the pseudo-terminal.";
+						goto cleanup;
+					}
+				}
+				else if(reference)
+				{
+					uint32_t j;
+
+					for(j = 0; j < chunks[i].length; j++)
+						baseline_decode(reference, chunks[i].data[j]);
+				}
+				else
+				{
+					telem_feed(telem, chunks[i].data, chunks[i].length);
+				}
+				end = replay_now();
+
+				decode_time += end - begin;
+
+				replay_stats(telem, reference, &stats);
+				frames = stats.frames - frames;
+				if(frames)
+					latencies[latency_count++] = (end - begin) / frames;
+			}
+		}
+
+		cpu_time = replay_cpu_time() - cpu_start;
+		replay_stats(telem, reference, &stats);
+		qsort(latencies, latency_count, sizeof(uint64_t), compare_u64);
+
+		printf("protocol     %s%s\n", protocol_names[protocol], raw ? " (raw)" : "");
+		printf("mode         %s%s, %s\n", pty ? "pty" : "memory", reference ? " baseline" : "", realtime ? "real time" : "as fast as possible");
+		printf("chunks       %zu x %d\n", chunk_count, loops);
+		printf("bytes        %llu\n", (unsigned long long)stats.bytes);
+		printf("frames       %u\n", stats.frames);
+		printf("errors       %u\n", stats.errors);
+		printf("wall time    %.3f s\n", (replay_now() - start) / 1e9);
+		printf("cpu time     %.3f s\n", cpu_time / 1e6);
+
+		if(stats.frames)
+		{
+			printf("cpu/frame    %.2f us\n", (double)cpu_time / stats.frames);
+			if(pty)
+				printf("reads/frame  %.3f (%u reads)\n", (double)stats.reads / stats.frames, stats.reads);
+		}
+
+		if(decode_time)
+		{
+			printf("throughput   %.2f MB/s\n", stats.bytes / (decode_time / 1e9) / 1e6);
+			printf("frame rate   %.0f frames/s\n", stats.frames / (decode_time / 1e9));
+		}
+
+		if(latency_count)
+		{
+			printf("latency/frame p50 %llu ns, p90 %llu ns, p99 %llu ns, max %llu ns\n",
+				(unsigned long long)latencies[latency_count * 50 / 100],
+				(unsigned long long)latencies[latency_count * 90 / 100],
+				(unsigned long long)latencies[latency_count * 99 / 100],
+				(unsigned long long)latencies[latency_count - 1]);
+		}
+	}
+
+	// Final value table
+	{
+		int id;
+
+		printf("\naltitude     %d cm\n", telem_get_altitude(telem));
+		printf("heading      %u\n", telem_get_heading(telem));
+		printf("vfas         %u mV\n", telem_get_vfas_voltage(telem));
+		printf("cells        %u (last %u mV)\n", telem_get_cells(telem), telem_get_cell_voltage(telem));
+
+		printf("\n id   value\n");
+		for(id = 0; id < 256; id++)
+		{
+			uint16_t value = reference ? reference->values[id] : telem_get_raw(telem, id);
+			if(value) printf("0x%02x %6u\n", id, value);
+		}
+	}
+
+cleanup:
+	if(telem) telem_close(telem);
+	if(master >= 0) close(master);
+	if(slave >= 0) close(slave);
+	if(data != MAP_FAILED) munmap(data, length);
+	if(fd >= 0) close(fd);
+	free(chunks);
+	free(latencies);
+
+	if(error)
+	{
+		fprintf(stderr, "Fatal error: %s\n", error);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,205 @@
+#include "telem_protocol.h"
+
+#include <string.h>
+
+#define SPORT_DATA_FRAME 0x10
+#define SPORT_ESCAPE 0x7d
+#define SPORT_START 0x7e
+
+#define SPORT_ALT 0x0100
+#define SPORT_VARIO 0x0110
+#define SPORT_CURR 0x0200
+#define SPORT_VFAS 0x0210
+#define SPORT_CELLS 0x0300
+#define SPORT_T1 0x0400
+#define SPORT_T2 0x0410
+#define SPORT_RPM 0x0500
+#define SPORT_FUEL 0x0600
+#define SPORT_GPS_LONG_LATI 0x0800
+#define SPORT_GPS_ALT 0x0820
+#define SPORT_GPS_SPEED 0x0830
+#define SPORT_GPS_COURS 0x0840
+
+#define SPORT_BODY_SIZE 8
+
+static const uint8_t sport_special[256] = {
+	[SPORT_ESCAPE] = 1,
+	[SPORT_START] = 1,
+};
+
+static int sport_check(const uint8_t *body)
+{
+	uint16_t crc = 0;
+	int i;
+
+	for(i = 0; i < SPORT_BODY_SIZE - 1; i++)
+	{
+		crc += body[i];
+		crc += crc >> 8;
+		crc &= 0xff;
+	}
+
+	return body[SPORT_BODY_SIZE - 1] == 0xff - crc;
+}
+
+static void sport_receive(telem_t telem, uint16_t id, uint32_t value)
+{
+	// Sensors of the same type occupy a range of 16 IDs
+	switch(id & 0xfff0)
+	{
+		case SPORT_ALT:
+			telem_receive_altitude(telem, (int32_t)value);
+			break;
+
+		case SPORT_VARIO:
+			telem_receive(telem, TELEM_ID_VARIO, (uint16_t)(int16_t)(int32_t)value);
+			break;
+
+		case SPORT_CURR:
+			telem_receive(telem, TELEM_ID_CURRENT, value);
+			break;
+
+		case SPORT_VFAS:
+			telem_receive_vfas(telem, value * 10);
+			break;
+
+		case SPORT_CELLS:
+		{
+			// Two 12-bit cells in 2 mV units, after the first cell index and
+			// the total cell count
+			uint8_t cell = value & 0x0f;
+			uint8_t cells = (value >> 4) & 0x0f;
+
+			telem_receive_cell(telem, cell, ((value >> 8) & 0xfff) * 2);
+			if(cell + 1 < cells)
+				telem_receive_cell(telem, cell + 1, ((value >> 20) & 0xfff) * 2);
+
+			break;
+		}
+
+		case SPORT_T1:
+			telem_receive(telem, TELEM_ID_TEMP1, value);
+			break;
+
+		case SPORT_T2:
+			telem_receive(telem, TELEM_ID_TEMP2, value);
+			break;
+
+		case SPORT_RPM:
+			telem_receive(telem, TELEM_ID_RPM, value);
+			break;
+
+		case SPORT_FUEL:
+			telem_receive(telem, TELEM_ID_FUEL, value);
+			break;
+
+		case SPORT_GPS_LONG_LATI:
+		{
+			// Bit 31 selects longitude, bit 30 the sign, and the rest is in
+			// 1/10000 minutes
+			int32_t degrees_e7 = (int32_t)(((uint64_t)(value & 0x3fffffff) * 50) / 3);
+			if(value & (1u << 30)) degrees_e7 = -degrees_e7;
+
+			if(value & (1u << 31))
+				telem_receive_longitude(telem, degrees_e7);
+			else
+				telem_receive_latitude(telem, degrees_e7);
+
+			break;
+		}
+
+		case SPORT_GPS_ALT:
+			telem_receive_gps_altitude(telem, (int32_t)value);
+			break;
+
+		case SPORT_GPS_SPEED:
+			telem_receive_speed(telem, value);
+			break;
+
+		case SPORT_GPS_COURS:
+			telem_receive_heading(telem, value);
+			break;
+	}
+}
+
+static size_t sport_decode(telem_t telem, const uint8_t *data, size_t length)
+{
+	const uint8_t *end = data + length;
+	const uint8_t *p = data;
+
+	while(p < end)
+	{
+		const uint8_t *body, *start;
+		uint8_t frame[SPORT_BODY_SIZE];
+		int i;
+
+		start = memchr(p, SPORT_START, end - p);
+		if(!start) return length;
+
+		// Skip the physical ID; a poll with no reply is followed directly by
+		// the next start byte
+		p = start + 1;
+		if(p >= end) return start - data;
+		if(*p == SPORT_START) continue;
+		p++;
+
+		// Fast path: decode an unstuffed frame in place
+		for(i = 0; i < SPORT_BODY_SIZE && p + i < end && !sport_special[p[i]]; i++);
+		if(i == SPORT_BODY_SIZE)
+		{
+			body = p;
+			p += SPORT_BODY_SIZE;
+		}
+		else
+		{
+			for(i = 0; i < SPORT_BODY_SIZE; i++)
+			{
+				if(p >= end) return start - data;
+				if(*p == SPORT_START) break;
+
+				if(*p == SPORT_ESCAPE)
+				{
+					if(++p >= end) return start - data;
+					if(*p == SPORT_START) break;
+					frame[i] = *p++ ^ 0x20;
+				}
+				else
+				{
+					frame[i] = *p++;
+				}
+			}
+
+			// Truncated by a new start byte; resume the scan from it
+			if(i < SPORT_BODY_SIZE)
+			{
+				telem_frame_error(telem);
+				continue;
+			}
+
+			body = frame;
+		}
+
+		if(!sport_check(body))
+		{
+			telem_frame_error(telem);
+			continue;
+		}
+
+		telem_frame(telem);
+		if(body[0] != SPORT_DATA_FRAME)
+			continue;
+
+		sport_receive(telem,
+			(uint16_t)body[1] | ((uint16_t)body[2] << 8),
+			(uint32_t)body[3] | ((uint32_t)body[4] << 8) | ((uint32_t)body[5] << 16) | ((uint32_t)body[6] << 24));
+	}
+
+	return length;
+}
+
+const struct telem_protocol telem_protocol_sport = {
+	.name = "sport",
+	.decode = sport_decode,
+	.baud = 57600,
+	.min_frame = 2 + SPORT_BODY_SIZE,
+};
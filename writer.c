@@ -0,0 +1,416 @@
+#include "writer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WRITER_CACHE_LINE 64
+
+// Data goes to the file in whole blocks at block-aligned offsets, apart from
+// the end of each segment (bytes)
+#define WRITER_BLOCK (256 * 1024)
+
+// A write taking longer than this counts as a stall (microseconds)
+#define WRITER_SLOW 100000
+
+// Segment boundaries the producer can have outstanding
+#define WRITER_SPLITS 16
+
+#define WRITER_PATH_MAX 256
+
+// Bytes from one producer, the encoder callback, go through a ring to a thread
+// that writes them out, so a slow card holds up the thread and not the
+// encoder. The producer owns head and its statistics, the writer thread owns
+// tail and the rest, and each only reads the other's position. Positions run
+// freely and wrap through the power-of-two size.
+//
+// The output is a run of numbered segment files. The producer marks where a
+// new one starts with writer_split, through a second queue of positions that
+// works the same way.
+//
+// The eventfd counts blocks the producer has completed, and segment marks, so
+// the thread can sleep in a blocking read and never miss one.
+struct writer
+{
+	_Alignas(WRITER_CACHE_LINE) atomic_size_t head;
+	atomic_uint splits_head;
+	uint64_t dropped;
+	uint32_t overruns;
+	size_t depth_max;
+
+	_Alignas(WRITER_CACHE_LINE) atomic_size_t tail;
+	atomic_uint splits_tail;
+	uint64_t written;
+	uint32_t slow_writes;
+	uint32_t errors;
+	uint32_t segments;
+	histogram_t write_time;
+	histogram_t sync_time;
+
+	// Writer thread: position in the current file, and when it was last synced
+	uint64_t file_offset;
+	uint64_t sync_last;
+	int status;
+
+	_Alignas(WRITER_CACHE_LINE) size_t size;
+	uint8_t *buffer;
+	size_t splits[WRITER_SPLITS];
+	uint64_t sync_interval;
+	char prefix[WRITER_PATH_MAX];
+	char extension[16];
+	int fd;
+	int event_fd;
+	atomic_int stopping;
+	int running;
+	pthread_t thread;
+};
+
+static const char *_error;
+
+static uint64_t writer_now(void)
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000 + ((uint64_t)time.tv_nsec + 500) / 1000;
+}
+
+// Segments are fdatasync'd every sync_interval microseconds while they are
+// written, or only when they close if it is 0
+writer_t writer_init(size_t size, uint64_t sync_interval)
+{
+	writer_t writer = 0;
+
+	if(size < WRITER_BLOCK || (size & (size - 1)))
+	{
+		_error = "Writer buffer must be a power of two of at least one block.";
+		goto fail;
+	}
+
+	if(posix_memalign((void **)&writer, WRITER_CACHE_LINE, sizeof(struct writer)))
+	{
+		writer = 0;
+		_error = "Failed to allocate writer object.";
+		goto fail;
+	}
+	memset(writer, 0, sizeof(struct writer));
+
+	writer->size = size;
+	writer->sync_interval = sync_interval;
+	writer->fd = -1;
+
+	writer->event_fd = eventfd(0, EFD_CLOEXEC);
+	if(writer->event_fd < 0)
+	{
+		_error = "Failed to create writer event.";
+		goto fail;
+	}
+
+	// Page aligned, so every block is too
+	if(posix_memalign((void **)&writer->buffer, 4096, size))
+	{
+		writer->buffer = 0;
+		_error = "Failed to allocate writer buffer.";
+		goto fail;
+	}
+
+	return writer;
+
+fail:
+	writer_deinit(writer);
+	return 0;
+}
+
+void writer_deinit(writer_t writer)
+{
+	if(writer)
+	{
+		if(writer->running) writer_stop(writer);
+		if(writer->event_fd >= 0) close(writer->event_fd);
+		free(writer->buffer);
+		free(writer);
+	}
+}
+
+const char *writer_error(void)
+{
+	return _error;
+}
+
+static int writer_open_segment(writer_t writer)
+{
+	char path[WRITER_PATH_MAX + 32];
+
+	snprintf(path, sizeof(path), "%s.%03u%s", writer->prefix, writer->segments, writer->extension);
+
+	writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(writer->fd < 0) return 1;
+
+	writer->segments++;
+	writer->file_offset = 0;
+	writer->sync_last = writer_now();
+	return 0;
+}
+
+static void writer_sync(writer_t writer)
+{
+	uint64_t start = writer_now();
+
+	if(fdatasync(writer->fd)) writer->errors++;
+
+	writer->sync_last = writer_now();
+	histogram_add(&writer->sync_time, writer->sync_last - start);
+}
+
+static int writer_close_segment(writer_t writer)
+{
+	int status = 0;
+
+	if(writer->fd < 0) return 1;
+
+	writer_sync(writer);
+	if(close(writer->fd)) status = 1;
+	writer->fd = -1;
+
+	return status;
+}
+
+static void *writer_thread(void *data)
+{
+	writer_t writer = (writer_t)data;
+	size_t tail = atomic_load_explicit(&writer->tail, memory_order_relaxed);
+	unsigned int splits_tail = atomic_load_explicit(&writer->splits_tail, memory_order_relaxed);
+
+	while(1)
+	{
+		// A mark is read before head, so the data before it has arrived
+		unsigned int splits_head = atomic_load_explicit(&writer->splits_head, memory_order_acquire);
+		size_t head = atomic_load_explicit(&writer->head, memory_order_acquire);
+		int stopping = atomic_load_explicit(&writer->stopping, memory_order_acquire);
+		int split = splits_head != splits_tail;
+		size_t offset = tail & (writer->size - 1);
+		size_t length = head - tail;
+		uint64_t start;
+		ssize_t count;
+
+		// A segment ends where the producer marked it, and the next one starts
+		if(split)
+		{
+			size_t position = writer->splits[splits_tail % WRITER_SPLITS];
+
+			if(tail == position)
+			{
+				if(writer_close_segment(writer) | writer_open_segment(writer))
+					writer->errors++;
+
+				atomic_store_explicit(&writer->splits_tail, ++splits_tail, memory_order_release);
+				continue;
+			}
+
+			length = position - tail;
+		}
+
+		if(length < WRITER_BLOCK && !((stopping || split) && length))
+		{
+			eventfd_t events;
+
+			if(stopping) break;
+			eventfd_read(writer->event_fd, &events);
+			continue;
+		}
+
+		// Writes end on block boundaries in the file, apart from the last of a
+		// segment and those cut short by the end of the buffer
+		if(length > writer->size - offset)
+			length = writer->size - offset;
+		else if(!stopping && !split)
+			length -= (writer->file_offset + length) % WRITER_BLOCK;
+
+		start = writer_now();
+		count = writer->fd >= 0 ? write(writer->fd, writer->buffer + offset, length) : -1;
+		if(count < 0 && errno == EINTR) continue;
+
+		{
+			uint64_t time = writer_now() - start;
+
+			histogram_add(&writer->write_time, time);
+			if(time >= WRITER_SLOW) writer->slow_writes++;
+		}
+
+		// A failed write loses its data rather than blocking the encoder
+		if(count <= 0)
+		{
+			writer->errors++;
+			count = length;
+		}
+		else
+		{
+			writer->written += count;
+		}
+
+		writer->file_offset += count;
+		tail += count;
+		atomic_store_explicit(&writer->tail, tail, memory_order_release);
+
+		// Off the encoder's path, so a slow sync only backs up the buffer
+		if(writer->fd >= 0 && writer->sync_interval && writer_now() - writer->sync_last >= writer->sync_interval)
+			writer_sync(writer);
+	}
+
+	writer->status = writer_close_segment(writer);
+	return 0;
+}
+
+// Files are named prefix.000 and up, followed by the extension
+int writer_start(writer_t writer, const char *prefix, const char *extension)
+{
+	if(writer->running)
+	{
+		_error = "Writer is already running.";
+		return 1;
+	}
+
+	snprintf(writer->prefix, sizeof(writer->prefix), "%s", prefix);
+	snprintf(writer->extension, sizeof(writer->extension), "%s", extension);
+	writer->segments = 0;
+
+	if(writer_open_segment(writer))
+	{
+		_error = "Failed to open output file.";
+		return 1;
+	}
+
+	atomic_store_explicit(&writer->head, 0, memory_order_relaxed);
+	atomic_store_explicit(&writer->tail, 0, memory_order_relaxed);
+	atomic_store_explicit(&writer->splits_head, 0, memory_order_relaxed);
+	atomic_store_explicit(&writer->splits_tail, 0, memory_order_relaxed);
+	atomic_store_explicit(&writer->stopping, 0, memory_order_relaxed);
+
+	if(pthread_create(&writer->thread, 0, writer_thread, writer))
+	{
+		_error = "Failed to start writer thread.";
+		close(writer->fd);
+		writer->fd = -1;
+		return 1;
+	}
+
+	writer->running = 1;
+	return 0;
+}
+
+void writer_stats(writer_t writer, writer_stats_t *stats)
+{
+	stats->written = writer->written;
+	stats->dropped = writer->dropped;
+	stats->overruns = writer->overruns;
+	stats->slow_writes = writer->slow_writes;
+	stats->errors = writer->errors;
+	stats->segments = writer->segments;
+	stats->depth_max = writer->depth_max;
+	stats->size = writer->size;
+	stats->write_time = writer->write_time;
+	stats->sync_time = writer->sync_time;
+}
+
+// Writes out whatever is left and closes the file. The producer must have
+// stopped.
+int writer_stop(writer_t writer)
+{
+	int status = 0;
+
+	if(!writer->running)
+	{
+		_error = "Writer is not running.";
+		return 1;
+	}
+
+	atomic_store_explicit(&writer->stopping, 1, memory_order_release);
+	eventfd_write(writer->event_fd, 1);
+	pthread_join(writer->thread, 0);
+	writer->running = 0;
+
+	if(writer->status)
+	{
+		_error = "Failed to close output file.";
+		status = 1;
+	}
+
+	return status;
+}
+
+// Whether writer_split has room for a mark. Only the producer adds marks, so
+// the answer holds until it makes the next split.
+int writer_split_ready(writer_t writer)
+{
+	unsigned int splits_head = atomic_load_explicit(&writer->splits_head, memory_order_relaxed);
+	unsigned int splits_tail = atomic_load_explicit(&writer->splits_tail, memory_order_acquire);
+
+	return splits_head - splits_tail < WRITER_SPLITS;
+}
+
+// Starts a new segment with the next data written. Returns 1, leaving the
+// segment running on, if too many are still waiting.
+int writer_split(writer_t writer)
+{
+	unsigned int splits_head = atomic_load_explicit(&writer->splits_head, memory_order_relaxed);
+
+	if(!writer_split_ready(writer)) return 1;
+
+	writer->splits[splits_head % WRITER_SPLITS] = atomic_load_explicit(&writer->head, memory_order_relaxed);
+	atomic_store_explicit(&writer->splits_head, splits_head + 1, memory_order_release);
+	eventfd_write(writer->event_fd, 1);
+
+	return 0;
+}
+
+// Copies data into the ring, or drops all of it when it doesn't fit
+int writer_write(writer_t writer, const void *data, size_t length)
+{
+	struct iovec part = {(void *)data, length};
+
+	return writer_writev(writer, &part, 1);
+}
+
+// The same for data in parts, which go in together or not at all
+int writer_writev(writer_t writer, const struct iovec *parts, int count)
+{
+	size_t head = atomic_load_explicit(&writer->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&writer->tail, memory_order_acquire);
+	size_t position = head, length = 0;
+	int i;
+
+	for(i = 0; i < count; i++)
+		length += parts[i].iov_len;
+
+	if(length > writer->size - (head - tail))
+	{
+		writer->overruns++;
+		writer->dropped += length;
+		return 1;
+	}
+
+	for(i = 0; i < count; i++)
+	{
+		size_t offset = position & (writer->size - 1);
+		size_t first = writer->size - offset;
+
+		if(first > parts[i].iov_len) first = parts[i].iov_len;
+		memcpy(writer->buffer + offset, parts[i].iov_base, first);
+		memcpy(writer->buffer, (const uint8_t *)parts[i].iov_base + first, parts[i].iov_len - first);
+		position += parts[i].iov_len;
+	}
+
+	atomic_store_explicit(&writer->head, head + length, memory_order_release);
+
+	if(head + length - tail > writer->depth_max) writer->depth_max = head + length - tail;
+	if((head + length) / WRITER_BLOCK != head / WRITER_BLOCK)
+		eventfd_write(writer->event_fd, 1);
+
+	return 0;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "histogram.h"
+
+typedef struct
+{
+	uint64_t written;
+	uint64_t dropped;
+	uint32_t overruns;
+	uint32_t slow_writes;
+	uint32_t errors;
+	uint32_t segments;
+	size_t depth_max;
+	size_t size;
+	histogram_t write_time;
+	histogram_t sync_time;
+} writer_stats_t;
+
+typedef struct writer *writer_t;
+
+writer_t writer_init(size_t size, uint64_t sync_interval);
+void writer_deinit(writer_t writer);
+const char *writer_error(void);
+
+int writer_split(writer_t writer);
+int writer_split_ready(writer_t writer);
+int writer_start(writer_t writer, const char *prefix, const char *extension);
+void writer_stats(writer_t writer, writer_stats_t *stats);
+int writer_stop(writer_t writer);
+int writer_write(writer_t writer, const void *data, size_t length);
+int writer_writev(writer_t writer, const struct iovec *parts, int count);